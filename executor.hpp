@@ -0,0 +1,197 @@
+#ifndef EXECUTOR_M4P9J7WB
+#define EXECUTOR_M4P9J7WB
+
+#include <deque>
+#include <vector>
+#include <thread>
+
+#include "messageable.hpp"
+
+// Fixed set of threads running posted tasks
+// in FIFO order.
+struct ThreadPoolExecutor {
+    typedef std::function< void() > Task;
+
+    explicit ThreadPoolExecutor(int threads) :
+        _stop(false)
+    {
+        assert( threads > 0 && "Pool needs threads." );
+        for (int i = 0; i < threads; ++i) {
+            _threads.emplace_back([=]() { workerLoop(); });
+        }
+    }
+
+    ThreadPoolExecutor(const ThreadPoolExecutor&) = delete;
+    ThreadPoolExecutor(ThreadPoolExecutor&&) = delete;
+
+    ~ThreadPoolExecutor() {
+        stop();
+    }
+
+    // may be called from any thread,
+    // tasks after stop are dropped
+    void post(Task task) {
+        {
+            std::lock_guard< std::mutex > g(_mtx);
+            if (_stop) {
+                return;
+            }
+            _tasks.push_back(std::move(task));
+        }
+        _cond.notify_one();
+    }
+
+    int threadCount() const {
+        return static_cast<int>(_threads.size());
+    }
+
+    // runs tasks already posted, then joins
+    void stop() {
+        {
+            std::lock_guard< std::mutex > g(_mtx);
+            _stop = true;
+        }
+        _cond.notify_all();
+
+        for (auto& i: _threads) {
+            if (i.joinable()) {
+                i.join();
+            }
+        }
+    }
+
+private:
+    void workerLoop() {
+        std::unique_lock< std::mutex > l(_mtx);
+        for (;;) {
+            _cond.wait(l,[=]() { return _stop || !_tasks.empty(); });
+            if (_tasks.empty()) {
+                return;
+            }
+
+            Task task(std::move(_tasks.front()));
+            _tasks.pop_front();
+            l.unlock();
+            task();
+            l.lock();
+        }
+    }
+
+    std::mutex _mtx;
+    std::condition_variable _cond;
+    std::deque< Task > _tasks;
+    bool _stop;
+    std::vector< std::thread > _threads;
+};
+
+typedef std::shared_ptr< ThreadPoolExecutor > ExecutorPtr;
+
+// Hands async packs to async message of wrapped
+// messageable on pool threads, so caller never runs
+// target's handling. Packs may be handled concurrently,
+// target has to be thread safe.
+// Sync messages go straight to target.
+struct ExecutorMessageable : public Messageable {
+    ExecutorMessageable(const ExecutorPtr& pool,
+        const StrongMsgPtr& target) :
+        _pool(pool), _target(target)
+    {
+        assert( nullptr != pool && nullptr != target
+            && "Executor needs pool and target." );
+    }
+
+    void message(const StrongPackPtr& msg) override {
+        auto target = _target;
+        _pool->post([target,msg]() {
+            target->message(msg);
+        });
+    }
+
+    void message(templatious::VirtualPack& msg) override {
+        _target->message(msg);
+    }
+
+private:
+    ExecutorPtr _pool;
+    StrongMsgPtr _target;
+};
+
+// Same as above, but packs are handled one at a
+// time in enqueue order, so target needs no locking.
+// Holds no thread, at most one drain task of a
+// strand is posted to the pool at a time.
+// Sync messages run on caller thread, but never
+// concurrently with a drain, they aren't ordered
+// with queued packs.
+// Must be created with std::make_shared.
+struct StrandMessageable :
+    public Messageable,
+    public std::enable_shared_from_this< StrandMessageable >
+{
+    // batch is how many packs a drain handles
+    // before giving pool to other tasks
+    StrandMessageable(const ExecutorPtr& pool,
+        const StrongMsgPtr& target,int batch = 64) :
+        _pool(pool), _target(target),
+        _batch(batch), _pending(0)
+    {
+        assert( nullptr != pool && nullptr != target
+            && "Strand needs pool and target." );
+        assert( batch > 0 && "Batch must be positive." );
+    }
+
+    void message(const StrongPackPtr& msg) override {
+        _queue.push(msg);
+        // first pending pack posts the drain,
+        // running drain takes care of the rest
+        if (0 == _pending.fetch_add(1)) {
+            postDrain();
+        }
+    }
+
+    // waits for batch in flight, if any
+    void message(templatious::VirtualPack& msg) override {
+        std::lock_guard< std::recursive_mutex > g(_runMtx);
+        _target->message(msg);
+    }
+
+private:
+    void postDrain() {
+        auto self = shared_from_this();
+        _pool->post([self]() { self->drain(); });
+    }
+
+    void drain() {
+        int done = 0;
+        {
+            // target may message strand synchronously
+            std::lock_guard< std::recursive_mutex > g(_runMtx);
+            StrongPackPtr pack;
+            while (done < _batch && _queue.pop(pack)) {
+                _target->message(pack);
+                pack = nullptr;
+                ++done;
+            }
+        }
+
+        // counted, but producer is still
+        // in the middle of push
+        if (0 == done) {
+            std::this_thread::yield();
+        }
+
+        if (_pending.fetch_sub(done) - done > 0) {
+            postDrain();
+        }
+    }
+
+    ExecutorPtr _pool;
+    StrongMsgPtr _target;
+    int _batch;
+    std::atomic< int > _pending;
+    MpscQueue< StrongPackPtr > _queue;
+    // serializes drain and sync messages
+    std::recursive_mutex _runMtx;
+};
+
+#endif /* end of include guard: EXECUTOR_M4P9J7WB */
@@ -0,0 +1,204 @@
+#ifndef LUAFUTURE_Q2K7N4ZD
+#define LUAFUTURE_Q2K7N4ZD
+
+#include <tuple>
+#include <vector>
+
+#include <templatious/FullPack.hpp>
+
+#include "plumbing.hpp"
+
+// Result of LuaContext::request, copies of handle
+// share the same result. Values are copied out of
+// the pack once handler is done with it, so pack
+// itself is gone by the time anyone reads them.
+template <class... T>
+struct LuaFuture {
+    typedef std::tuple< T... > Values;
+    typedef std::function< void(const LuaFuture&) > Continuation;
+
+    // invalid handle
+    LuaFuture() {}
+
+    bool valid() const {
+        return nullptr != _state;
+    }
+
+    // fulfilled or failed
+    bool ready() const {
+        std::lock_guard< std::mutex > g(_state->_mtx);
+        return PENDING != _state->_status;
+    }
+
+    void wait() const {
+        std::unique_lock< std::mutex > l(_state->_mtx);
+        _state->_cond.wait(l,[=]() { return PENDING != _state->_status; });
+    }
+
+    // returns false if still pending after timeout
+    bool waitFor(std::chrono::steady_clock::duration timeout) const {
+        std::unique_lock< std::mutex > l(_state->_mtx);
+        return _state->_cond.wait_for(l,timeout,
+            [=]() { return PENDING != _state->_status; });
+    }
+
+    /**
+     * Waits, false if pack was rejected or dropped
+     * before handler used it.
+     */
+    bool ok() const {
+        wait();
+        return FULFILLED == _state->_status;
+    }
+
+    // waits, only valid if ok
+    const Values& get() const {
+        bool isOk = ok();
+        assert( isOk && "Request failed, no values." );
+        return _state->_values;
+    }
+
+    template <int i>
+    const typename std::tuple_element< i, Values >::type& fGet() const {
+        return std::get< i >(get());
+    }
+
+    /**
+     * Run continuation once ready, with this future.
+     * Runs right away if already ready, else on thread
+     * that settles it (usually context thread), so it
+     * shouldn't block, post to executor if heavy.
+     */
+    void then(Continuation cont) const {
+        {
+            std::lock_guard< std::mutex > g(_state->_mtx);
+            if (PENDING == _state->_status) {
+                _state->_continuations.push_back(std::move(cont));
+                return;
+            }
+        }
+        cont(*this);
+    }
+
+private:
+    friend struct LuaContext;
+
+    enum Status {
+        PENDING,
+        FULFILLED,
+        FAILED
+    };
+
+    struct State {
+        State() : _status(PENDING) {}
+
+        std::mutex _mtx;
+        std::condition_variable _cond;
+        Status _status;
+        Values _values;
+        std::vector< Continuation > _continuations;
+    };
+
+    typedef std::shared_ptr< State > StatePtr;
+
+    template <int i,int n>
+    struct CopyValues {
+        template <class Core>
+        static void copy(Values& out,const Core& core) {
+            std::get< i >(out) = core.template fGet< i >();
+            CopyValues< i + 1, n >::copy(out,core);
+        }
+    };
+
+    template <int n>
+    struct CopyValues< n, n > {
+        template <class Core>
+        static void copy(Values&,const Core&) {}
+    };
+
+    // Owned by pack callback. Settles future when
+    // callback fires, fails it if pack dies first.
+    struct Link {
+        explicit Link(const StatePtr& state) : _state(state) {}
+
+        Link(const Link&) = delete;
+        Link(Link&&) = delete;
+
+        ~Link() {
+            if (nullptr != _state) {
+                settle(_state,FAILED,nullptr);
+            }
+        }
+
+        void fire(const TEMPLATIOUS_VPCORE< T... >& core) {
+            StatePtr state = std::move(_state);
+            _state = nullptr;
+            if (nullptr != state) {
+                settle(state,FULFILLED,&core);
+            }
+        }
+
+        StatePtr _state;
+    };
+
+    explicit LuaFuture(const StatePtr& state) : _state(state) {}
+
+    static void settle(const StatePtr& state,Status status,
+        const TEMPLATIOUS_VPCORE< T... >* core)
+    {
+        std::vector< Continuation > conts;
+        {
+            std::lock_guard< std::mutex > g(state->_mtx);
+            if (nullptr != core) {
+                CopyValues< 0, sizeof...(T) >::copy(state->_values,*core);
+            }
+            state->_status = status;
+            conts.swap(state->_continuations);
+        }
+        state->_cond.notify_all();
+
+        LuaFuture self(state);
+        for (auto& i: conts) {
+            i(self);
+        }
+    }
+
+    StatePtr _state;
+};
+
+template <class... T,class... Args>
+LuaFuture< T... > LuaContext::request(
+    const StrongMsgPtr& target,Args&&... args)
+{
+    typedef LuaFuture< T... > Future;
+    typedef typename Future::Link Link;
+
+    auto state = std::make_shared< typename Future::State >();
+    {
+        auto link = std::make_shared< Link >(state);
+        auto p = templatious::StaticFactory::vpackPtrWCallback< T... >(
+            [link](const TEMPLATIOUS_VPCORE< T... >& core) {
+                link->fire(core);
+            },
+            std::forward< Args >(args)...);
+        // pack owns the only link now
+        link = nullptr;
+
+        // if rejected (or no target) future
+        // fails once pack goes out of scope
+        if (nullptr != target) {
+            target->tryMessage(p);
+        }
+    }
+    return Future(state);
+}
+
+template <class... T,class... Args>
+LuaFuture< T... > LuaContext::request(
+    const char* name,Args&&... args)
+{
+    return request< T... >(getMessageable(name),
+        std::forward< Args >(args)...);
+}
+
+#endif /* end of include guard: LUAFUTURE_Q2K7N4ZD */
@@ -4,6 +4,16 @@
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <limits>
+#include <cassert>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <chrono>
+
+#include "mpscqueue.hpp"
 
 namespace templatious {
     struct DynVPackFactory;
@@ -12,6 +22,90 @@ namespace templatious {
     struct VirtualPack;
 }
 
+// options for a single async send
+struct SendOptions {
+    typedef std::chrono::steady_clock Clock;
+
+    SendOptions() :
+        priority(0), deadline(Clock::time_point::max()) {}
+
+    // drop pack if not dispatched within timeout
+    void expireAfter(Clock::duration timeout) {
+        deadline = Clock::now() + timeout;
+    }
+
+    bool hasDeadline() const {
+        return deadline != Clock::time_point::max();
+    }
+
+    // priority lane, higher is more urgent
+    int priority;
+    // stale after this point, max means never
+    Clock::time_point deadline;
+};
+
+// Limits work done in one processing pass.
+// Zero on either axis means no limit there.
+struct ProcessBudget {
+    typedef std::chrono::steady_clock Clock;
+
+    ProcessBudget() :
+        _maxMessages(0), _taken(0), _deferred(0),
+        _deadline(Clock::time_point::max()) {}
+
+    ProcessBudget(int maxMessages,Clock::duration maxDuration) :
+        _maxMessages(maxMessages), _taken(0), _deferred(0),
+        _deadline(maxDuration > Clock::duration::zero() ?
+            Clock::now() + maxDuration : Clock::time_point::max())
+    {
+        assert( maxMessages >= 0 && "Negative message budget." );
+    }
+
+    // reserve one unit of work, false if exhausted
+    bool take() {
+        if (exhausted()) {
+            return false;
+        }
+        ++_taken;
+        return true;
+    }
+
+    bool exhausted() const {
+        if (_maxMessages > 0 && _taken >= _maxMessages) {
+            return true;
+        }
+        return _deadline != Clock::time_point::max()
+            && Clock::now() >= _deadline;
+    }
+
+    // report work left for the next pass
+    void defer(int count) {
+        _deferred += count;
+    }
+
+    int deferred() const {
+        return _deferred;
+    }
+
+    int taken() const {
+        return _taken;
+    }
+
+    // units left, -1 if not limited by count
+    int remaining() const {
+        if (_maxMessages <= 0) {
+            return -1;
+        }
+        return _taken < _maxMessages ? _maxMessages - _taken : 0;
+    }
+
+private:
+    int _maxMessages;
+    int _taken;
+    int _deferred;
+    Clock::time_point _deadline;
+};
+
 class Messageable {
 public:
     // this is for sending message across threads
@@ -21,65 +115,568 @@ public:
     // if we know we're on the same thread as GUI
     virtual void message(templatious::VirtualPack& msg) = 0;
 
+    // same as async message, but reports if message
+    // was accepted (bounded receivers may reject)
+    virtual bool tryMessage(const std::shared_ptr< templatious::VirtualPack >& msg) {
+        message(msg);
+        return true;
+    }
+
+    // same as above with per send options, receivers
+    // that don't support them just ignore them
+    virtual bool tryMessage(
+        const std::shared_ptr< templatious::VirtualPack >& msg,
+        const SendOptions& options)
+    {
+        return tryMessage(msg);
+    }
+
     virtual ~Messageable() {}
 };
 
 typedef std::shared_ptr< Messageable > StrongMsgPtr;
 typedef std::weak_ptr< Messageable > WeakMsgPtr;
+// Stays std::shared_ptr (atomic counts, separate
+// control block), factory hands packs out that way
+// and Messageable::message takes it by signature.
+// Single thread paths move it instead of copying.
 typedef std::shared_ptr<
     templatious::VirtualPack > StrongPackPtr;
 
+// enqueue is wait-free (unless bounded and full),
+// process/processPtr must only be called from
+// a single thread.
+//
+// Double buffered: queue nodes and the drain
+// buffer keep their capacity between rounds,
+// so steady state traffic doesn't allocate.
+//
+// Packs may be spread across priority lanes,
+// higher lane is processed first.
+//
+// Optionally coalesces packs by key, newer
+// pack replaces queued one with the same key.
+//
+// Processing may be budgeted, packs that
+// didn't fit are kept and go first next time.
+//
+// Packs past their deadline are dropped
+// before dispatch.
 struct MessageCache {
 
-    void enqueue(const StrongPackPtr& pack) {
-        Guard g(_mtx);
-        _queue.push_back(pack);
+    static const int MAX_LANES = 8;
+
+    // What to do when bounded cache is full.
+    enum class Overflow {
+        // wait until consumer makes room,
+        // never use from the processing thread
+        Block,
+        // evict oldest queued pack
+        // (from the lowest non empty lane)
+        DropOldest,
+        // silently discard incoming pack
+        DropNewest,
+        // discard incoming pack, enqueue returns false
+        Reject,
+    };
+
+    MessageCache() :
+        _laneCount(1), _lanesUsed(1), _highWater(0), _leftover(0), _size(0), _bound(0),
+        _policy(Overflow::Reject), _blocked(0), _dropped(0), _expired(0)
+    {
+        _popLock.clear();
+        for (auto& i: _budgets) {
+            i = std::numeric_limits<int>::max();
+        }
+        for (auto& i: _drainPos) {
+            i = 0;
+        }
     }
 
-    // returns process message count
-    template <class Func>
-    int process(Func&& f) {
-        std::vector< StrongPackPtr > steal;
+    // Writes coalescing key of the pack, returns
+    // false if pack shouldn't be coalesced.
+    // Called from producer threads.
+    typedef std::function<
+        bool(const templatious::VirtualPack&,std::string&)
+    > CoalesceKeyFunc;
+
+    // returns false if pack was rejected,
+    // priority is clamped to available lanes
+    bool enqueue(const StrongPackPtr& pack,int priority = 0) {
+        SendOptions options;
+        options.priority = priority;
+        return enqueue(pack,options);
+    }
+
+    // returns false if pack was rejected
+    bool enqueue(const StrongPackPtr& pack,const SendOptions& options) {
+        auto& queue = _queues[clampLane(options.priority)];
+
+        Entry e(pack,options.deadline);
+        auto keyFunc = std::atomic_load(&_coalesceKey);
+        bool coalesce = nullptr != keyFunc
+            && (*keyFunc)(*pack,e._key);
+
+        // replacing queued pack takes no room,
+        // so bound doesn't apply to it
+        StrongPackPtr replaced;
+        if (coalesce && replaceCoalesced(e,pack,replaced)) {
+            return true;
+        }
+
+        switch (admit()) {
+            case Admission::Drop:
+                return true;
+            case Admission::Reject:
+                return false;
+            case Admission::Queue:
+                break;
+        }
+
+        if (!coalesce) {
+            queue.push(std::move(e));
+            return true;
+        }
+
+        // queued entry keeps its place,
+        // only the pack behind it is swapped
         {
-            Guard g(_mtx);
-            if (0 == _queue.size()) {
-                return 0;
+            Guard g(_coalesceMtx);
+            auto iter = _coalesced.find(e._key);
+            if (iter != _coalesced.end()) {
+                // same key got queued while admitting
+                replaced = std::move(iter->second._pack);
+                iter->second = Pending(pack,e._deadline);
+            } else {
+                _coalesced.insert(std::make_pair(
+                    e._key,Pending(pack,e._deadline)));
+                e._pack = nullptr;
+                e._coalesced = true;
+                queue.push(std::move(e));
             }
-            steal = std::move(_queue);
         }
 
-        for (auto& i: steal) {
-            f(*i);
-            i = nullptr;
+        if (nullptr != replaced) {
+            _size.fetch_sub(1);
+            wakeBlocked();
+        }
+        return true;
+    }
+
+    /**
+     * Enable coalescing with key function,
+     * pass nullptr to disable. May be called
+     * while producers enqueue, packs already
+     * queued keep their coalescing state.
+     */
+    void setCoalescing(const CoalesceKeyFunc& keyFunc) {
+        std::shared_ptr< const CoalesceKeyFunc > swapped;
+        if (nullptr != keyFunc) {
+            swapped = std::make_shared< const CoalesceKeyFunc >(keyFunc);
+        }
+        std::atomic_store(&_coalesceKey,swapped);
+    }
+
+    /**
+     * Limit queued packs to maxSize with overflow
+     * policy. Zero maxSize (default) means unbounded.
+     */
+    void setBound(int maxSize,Overflow policy) {
+        _policy.store(policy,std::memory_order_relaxed);
+        _bound.store(maxSize,std::memory_order_release);
+        wakeBlocked();
+    }
+
+    /**
+     * Use count priority lanes (up to MAX_LANES),
+     * may be called at any time. Packs already in
+     * lanes above new count are still processed.
+     */
+    void setLanes(int count) {
+        assert( count >= 1 && count <= MAX_LANES
+            && "Lane count out of bounds." );
+        // only grows, consumer walks every
+        // lane that could hold packs
+        int used = _lanesUsed.load();
+        while (used < count &&
+            !_lanesUsed.compare_exchange_weak(used,count)) {}
+        _laneCount.store(count);
+    }
+
+    /**
+     * How many packs lane may process in one
+     * round before lower lanes get their turn.
+     * Unlimited by default (strict priority).
+     * Call from the processing thread.
+     */
+    void setLaneBudget(int lane,int budget) {
+        assert( lane >= 0 && lane < MAX_LANES && budget > 0
+            && "Invalid lane budget." );
+        _budgets[lane] = budget;
+    }
+
+    int laneCount() const {
+        return _laneCount.load();
+    }
+
+    // packs dropped by DropOldest/DropNewest so far
+    int droppedCount() const {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+    // packs dropped past their deadline so far
+    int expiredCount() const {
+        return _expired.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Trim policy, call from the processing thread.
+     * After processing, drain buffer capacity and
+     * spare queue nodes above highWater are freed.
+     * Zero (default) keeps everything.
+     */
+    void setHighWaterTrim(int highWater) {
+        _highWater = highWater;
+        for (auto& i: _queues) {
+            i.setSpareLimit(highWater > 0 ?
+                highWater : std::numeric_limits<int>::max());
         }
+    }
+
+    // returns process message count
+    template <class Func>
+    int process(Func&& f) {
+        ProcessBudget unlimited;
+        return process(std::forward<Func>(f),unlimited);
+    }
 
-        return steal.size();
+    // returns process message count
+    template <class Func>
+    int process(Func&& f,ProcessBudget& budget) {
+        return processPtr(
+            [&](const StrongPackPtr& pack) {
+                f(*pack);
+            },budget);
     }
 
     // returns process message count
     template <class Func>
     int processPtr(Func&& f) {
-        std::vector< StrongPackPtr > steal;
+        ProcessBudget unlimited;
+        return processPtr(std::forward<Func>(f),unlimited);
+    }
+
+    // Processes as much as budget allows,
+    // packs left over are processed first
+    // next time. Returns process message count.
+    // f gets non const pack reference and
+    // may move it out, cache drops it anyway.
+    template <class Func>
+    int processPtr(Func&& f,ProcessBudget& budget) {
+        // swap out, in case processing
+        // re-enters this cache
+        Batch steal[MAX_LANES];
+        size_t pos[MAX_LANES];
+        const int lanes = _lanesUsed.load();
+        for (int l = 0; l < lanes; ++l) {
+            std::swap(steal[l],_drainBufs[l]);
+            pos[l] = _drainPos[l];
+            _drainPos[l] = 0;
+        }
+
+        // messages enqueued while processing
+        // are left for the next round
+        int cnt = 0;
         {
-            Guard g(_mtx);
-            if (0 == _queue.size()) {
-                return 0;
+            PopGuard g(_popLock);
+            std::unique_lock< std::mutex > cl(
+                _coalesceMtx,std::defer_lock);
+            for (int l = 0; l < lanes; ++l) {
+                auto& out = steal[l];
+                cnt += _queues[l].drain(
+                    [&](Entry& e) {
+                        if (e._coalesced) {
+                            if (!cl.owns_lock()) {
+                                cl.lock();
+                            }
+                            out.push_back(takeCoalesced(e));
+                        } else {
+                            out.push_back(
+                                Pending(std::move(e._pack),e._deadline));
+                        }
+                    });
+            }
+        }
+        if (cnt > 0) {
+            _size.fetch_sub(cnt);
+            wakeBlocked();
+        }
+
+        // highest lane first, each lane handles
+        // up to its budget per round so lower
+        // lanes don't starve
+        int processed = 0;
+        bool left = true;
+        bool stopped = false;
+        while (left && !stopped) {
+            left = false;
+            for (int l = lanes - 1; l >= 0 && !stopped; --l) {
+                auto& batch = steal[l];
+                size_t laneBudget = _budgets[l];
+                size_t end = batch.size() - pos[l] > laneBudget ?
+                    pos[l] + laneBudget : batch.size();
+                for (; pos[l] < end; ++pos[l]) {
+                    auto& current = batch[pos[l]];
+                    // stale packs cost no budget,
+                    // dropping fires error callbacks
+                    if (current.expired()) {
+                        current._pack = nullptr;
+                        _expired.fetch_add(1,std::memory_order_relaxed);
+                        continue;
+                    }
+                    if (!budget.take()) {
+                        stopped = true;
+                        break;
+                    }
+                    f(current._pack);
+                    current._pack = nullptr;
+                    ++processed;
+                }
+                left |= pos[l] < batch.size();
             }
-            steal = std::move(_queue);
         }
 
-        for (auto& i: steal) {
-            f(i);
-            i = nullptr;
+        int leftover = 0;
+        for (int l = 0; l < lanes; ++l) {
+            auto& batch = steal[l];
+            // re-entrant call may have left newer packs
+            auto& nested = _drainBufs[l];
+            for (size_t i = _drainPos[l]; i < nested.size(); ++i) {
+                batch.push_back(std::move(nested[i]));
+            }
+
+            if (pos[l] == batch.size()) {
+                trim(batch);
+                pos[l] = 0;
+            } else if (pos[l] * 2 > batch.size()) {
+                batch.erase(batch.begin(),batch.begin() + pos[l]);
+                pos[l] = 0;
+            }
+
+            leftover += batch.size() - pos[l];
+            std::swap(batch,nested);
+            _drainPos[l] = pos[l];
         }
 
-        return steal.size();
+        _leftover = leftover;
+        if (leftover > 0) {
+            budget.defer(leftover);
+        }
+
+        return processed;
+    }
+
+    // queued plus left over from budgeted
+    // processing, call from processing thread
+    int pendingCount() const {
+        return _size.load() + _leftover;
     }
 
 private:
+    typedef SendOptions::Clock Clock;
+
+    struct Pending {
+        Pending() : _deadline(Clock::time_point::max()) {}
+
+        Pending(StrongPackPtr pack,Clock::time_point deadline) :
+            _pack(std::move(pack)), _deadline(deadline) {}
+
+        bool expired() const {
+            return _deadline != Clock::time_point::max()
+                && Clock::now() >= _deadline;
+        }
+
+        StrongPackPtr _pack;
+        Clock::time_point _deadline;
+    };
+
+    typedef std::vector< Pending > Batch;
     typedef std::lock_guard< std::mutex > Guard;
-    std::mutex _mtx;
-    std::vector< StrongPackPtr > _queue;
+
+    struct Entry {
+        Entry() :
+            _deadline(Clock::time_point::max()), _coalesced(false) {}
+
+        Entry(const StrongPackPtr& pack,Clock::time_point deadline) :
+            _pack(pack), _deadline(deadline), _coalesced(false) {}
+
+        // null if coalesced, pack is in the map then
+        StrongPackPtr _pack;
+        Clock::time_point _deadline;
+        std::string _key;
+        bool _coalesced;
+    };
+
+    enum class Admission {
+        Queue,
+        Drop,
+        Reject,
+    };
+
+    // reserves room for one pack according
+    // to bound and overflow policy
+    Admission admit() {
+        for (;;) {
+            int bound = _bound.load(std::memory_order_acquire);
+            int prev = _size.fetch_add(1);
+            if (0 == bound || prev < bound) {
+                return Admission::Queue;
+            }
+
+            switch (_policy.load(std::memory_order_relaxed)) {
+                case Overflow::DropOldest:
+                    evictOldest();
+                    return Admission::Queue;
+                case Overflow::DropNewest:
+                    _size.fetch_sub(1);
+                    _dropped.fetch_add(1,std::memory_order_relaxed);
+                    return Admission::Drop;
+                case Overflow::Reject:
+                    _size.fetch_sub(1);
+                    return Admission::Reject;
+                case Overflow::Block:
+                    _size.fetch_sub(1);
+                    waitForRoom(bound);
+                    break;
+            }
+        }
+    }
+
+    // swaps pack queued under the same key,
+    // false if there's none
+    bool replaceCoalesced(const Entry& e,const StrongPackPtr& pack,
+        StrongPackPtr& replaced)
+    {
+        Guard g(_coalesceMtx);
+        auto iter = _coalesced.find(e._key);
+        if (iter == _coalesced.end()) {
+            return false;
+        }
+        replaced = std::move(iter->second._pack);
+        iter->second = Pending(pack,e._deadline);
+        return true;
+    }
+
+    // _coalesceMtx must be held
+    Pending takeCoalesced(Entry& e) {
+        Pending result;
+        auto iter = _coalesced.find(e._key);
+        assert( iter != _coalesced.end()
+            && "Coalesced entry without pack." );
+        if (iter != _coalesced.end()) {
+            result = std::move(iter->second);
+            _coalesced.erase(iter);
+        }
+        return result;
+    }
+
+    // serializes consumer with evicting producers
+    struct PopGuard {
+        PopGuard(std::atomic_flag& f) : _f(f) {
+            while (_f.test_and_set(std::memory_order_acquire)) {}
+        }
+
+        ~PopGuard() {
+            _f.clear(std::memory_order_release);
+        }
+
+        std::atomic_flag& _f;
+    };
+
+    int clampLane(int priority) const {
+        if (priority < 0) {
+            return 0;
+        }
+        int count = _laneCount.load(std::memory_order_relaxed);
+        return priority < count ? priority : count - 1;
+    }
+
+    void trim(Batch& batch) {
+        batch.clear();
+        if (_highWater > 0 && batch.capacity() >
+            static_cast<size_t>(_highWater))
+        {
+            Batch trimmed;
+            trimmed.reserve(_highWater);
+            std::swap(trimmed,batch);
+        }
+    }
+
+    void evictOldest() {
+        Entry evicted;
+        Pending evictedPack;
+        bool popped = false;
+        {
+            PopGuard g(_popLock);
+            for (int l = 0; l < _lanesUsed.load() && !popped; ++l) {
+                popped = _queues[l].pop(evicted);
+            }
+            if (popped && evicted._coalesced) {
+                Guard cg(_coalesceMtx);
+                evictedPack = takeCoalesced(evicted);
+            }
+        }
+        // if nothing was visible yet bound
+        // is exceeded by one until next drain
+        if (popped) {
+            _size.fetch_sub(1);
+            _dropped.fetch_add(1,std::memory_order_relaxed);
+        }
+    }
+
+    void waitForRoom(int bound) {
+        std::unique_lock< std::mutex > l(_blockMtx);
+        _blocked.fetch_add(1);
+        _blockCond.wait(l,[&]() {
+            int current = _bound.load(std::memory_order_acquire);
+            return current != bound || _size.load() < bound;
+        });
+        _blocked.fetch_sub(1);
+    }
+
+    void wakeBlocked() {
+        if (_blocked.load() > 0) {
+            std::lock_guard< std::mutex > g(_blockMtx);
+            _blockCond.notify_all();
+        }
+    }
+
+    MpscQueue< Entry > _queues[MAX_LANES];
+    Batch _drainBufs[MAX_LANES];
+    // first unprocessed pack in drain buffer
+    size_t _drainPos[MAX_LANES];
+    int _budgets[MAX_LANES];
+    // lanes new packs are spread over
+    std::atomic< int > _laneCount;
+    // highest lane count ever set
+    std::atomic< int > _lanesUsed;
+    int _highWater;
+    int _leftover;
+
+    std::atomic< int > _size;
+    std::atomic< int > _bound;
+    std::atomic< Overflow > _policy;
+    std::atomic< int > _blocked;
+    std::atomic< int > _dropped;
+    std::atomic< int > _expired;
+    std::atomic_flag _popLock;
+    std::mutex _blockMtx;
+    std::condition_variable _blockCond;
+
+    // swapped atomically, producers read it
+    std::shared_ptr< const CoalesceKeyFunc > _coalesceKey;
+    std::mutex _coalesceMtx;
+    std::unordered_map< std::string, Pending > _coalesced;
 };
 
 struct NotifierCache {
@@ -0,0 +1,212 @@
+#ifndef MPSCQUEUE_Q7K2M4ZD
+#define MPSCQUEUE_Q7K2M4ZD
+
+#include <atomic>
+#include <utility>
+#include <limits>
+
+// Intrusive multi producer single consumer queue
+// (Dmitry Vyukov's design).
+// push is wait-free and may be called from any thread,
+// pop/drain may only be called from the single consumer.
+//
+// Popped nodes are kept in a spare pool and reused
+// by push, so steady state traffic doesn't allocate.
+template <class T>
+struct MpscQueue {
+
+    MpscQueue() :
+        _head(&_stub), _tail(&_stub),
+        _spare(nullptr), _spareCount(0),
+        _spareLimit(std::numeric_limits<int>::max())
+    {
+        _stub._next.store(nullptr,std::memory_order_relaxed);
+        _spareLock.clear();
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue(MpscQueue&&) = delete;
+
+    ~MpscQueue() {
+        T dummy;
+        while (pop(dummy)) {}
+
+        Node* spare = _spare.load(std::memory_order_acquire);
+        while (nullptr != spare) {
+            Node* next = spare->_next.load(std::memory_order_relaxed);
+            delete spare;
+            spare = next;
+        }
+    }
+
+    void push(const T& value) {
+        Node* n = acquireNode();
+        n->_value = value;
+        pushNode(n);
+    }
+
+    void push(T&& value) {
+        Node* n = acquireNode();
+        n->_value = std::move(value);
+        pushNode(n);
+    }
+
+    // consumer only, spare nodes above
+    // this count are freed instead of kept
+    void setSpareLimit(int limit) {
+        _spareLimit = limit;
+        while (_spareLock.test_and_set(std::memory_order_acquire)) {}
+        while (_spareCount.load(std::memory_order_relaxed) > _spareLimit) {
+            Node* n = popSpare();
+            if (nullptr == n) {
+                break;
+            }
+            delete n;
+        }
+        _spareLock.clear(std::memory_order_release);
+    }
+
+    // returns false if queue is empty or
+    // producer is in the middle of push, in which
+    // case element becomes visible shortly.
+    bool pop(T& out) {
+        Node* popped = nullptr;
+        return popNode(out,popped);
+    }
+
+    // Pops what was enqueued when drain started,
+    // packs pushed meanwhile wait for next drain
+    // so sustained producers can't keep it going.
+    // Returns popped count.
+    template <class Func>
+    int drain(Func&& f) {
+        Node* last = _head.load(std::memory_order_acquire);
+
+        int cnt = 0;
+        T val;
+        Node* popped = nullptr;
+        while (popNode(val,popped)) {
+            f(val);
+            ++cnt;
+            if (popped == last) {
+                break;
+            }
+            // stub is never popped, snapshot was taken
+            // right after pop requeued it behind a push
+            if (&_stub == last) {
+                last = _head.load(std::memory_order_acquire);
+            }
+        }
+        return cnt;
+    }
+
+private:
+    struct Node {
+        // doubles as spare pool link
+        std::atomic< Node* > _next;
+        T _value;
+    };
+
+    // popped is set to node value came from,
+    // only good for comparison after return
+    bool popNode(T& out,Node*& popped) {
+        Node* tail = _tail;
+        Node* next = tail->_next.load(std::memory_order_acquire);
+        if (&_stub == tail) {
+            if (nullptr == next) {
+                return false;
+            }
+            _tail = next;
+            tail = next;
+            next = next->_next.load(std::memory_order_acquire);
+        }
+
+        if (nullptr != next) {
+            _tail = next;
+            out = std::move(tail->_value);
+            popped = tail;
+            releaseNode(tail);
+            return true;
+        }
+
+        Node* head = _head.load(std::memory_order_acquire);
+        if (tail != head) {
+            return false;
+        }
+
+        pushNode(&_stub);
+        next = tail->_next.load(std::memory_order_acquire);
+        if (nullptr != next) {
+            _tail = next;
+            out = std::move(tail->_value);
+            popped = tail;
+            releaseNode(tail);
+            return true;
+        }
+
+        return false;
+    }
+
+    // any producer, only one at a time pops spare
+    // pool (guarded by _spareLock) so the pop can't
+    // suffer from ABA. Contended producers just allocate.
+    Node* acquireNode() {
+        if (!_spareLock.test_and_set(std::memory_order_acquire)) {
+            Node* n = popSpare();
+            _spareLock.clear(std::memory_order_release);
+            if (nullptr != n) {
+                return n;
+            }
+        }
+        return new Node();
+    }
+
+    Node* popSpare() {
+        Node* top = _spare.load(std::memory_order_acquire);
+        while (nullptr != top &&
+            !_spare.compare_exchange_weak(top,
+                top->_next.load(std::memory_order_relaxed),
+                std::memory_order_acq_rel,
+                std::memory_order_acquire)) {}
+
+        if (nullptr != top) {
+            _spareCount.fetch_sub(1,std::memory_order_relaxed);
+        }
+        return top;
+    }
+
+    // consumer only
+    void releaseNode(Node* n) {
+        if (_spareCount.load(std::memory_order_relaxed) >= _spareLimit) {
+            delete n;
+            return;
+        }
+
+        _spareCount.fetch_add(1,std::memory_order_relaxed);
+        Node* top = _spare.load(std::memory_order_relaxed);
+        do {
+            n->_next.store(top,std::memory_order_relaxed);
+        } while (!_spare.compare_exchange_weak(top,n,
+            std::memory_order_release,
+            std::memory_order_relaxed));
+    }
+
+    void pushNode(Node* n) {
+        n->_next.store(nullptr,std::memory_order_relaxed);
+        Node* prev = _head.exchange(n,std::memory_order_acq_rel);
+        prev->_next.store(n,std::memory_order_release);
+    }
+
+    // producers push here
+    std::atomic< Node* > _head;
+    // consumer only
+    Node* _tail;
+    Node _stub;
+
+    std::atomic< Node* > _spare;
+    std::atomic< int > _spareCount;
+    std::atomic_flag _spareLock;
+    int _spareLimit;
+};
+
+#endif /* end of include guard: MPSCQUEUE_Q7K2M4ZD */
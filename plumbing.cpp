@@ -8,7 +8,16 @@
 #include <templatious/FullPack.hpp>
 #include <templatious/detail/DynamicPackCreator.hpp>
 
+#include <algorithm>
+#include <exception>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
 #include "plumbing.hpp"
+#include "workstealingdeque.hpp"
 
 TEMPLATIOUS_TRIPLET_STD;
 
@@ -157,48 +166,488 @@ struct LuaContextPrimitives {
     }
 };
 
-typedef std::vector< std::pair<
-    bool, std::function<bool()>
-> > EventDriver;
+namespace {
 
-void CallbackCache::process() {
-    if (SA::size(_eventDriver) == 0) {
+    template <class T>
+    void appendBytes(const T& value,std::string& out) {
+        out.append(reinterpret_cast<const char*>(&value),sizeof(value));
+    }
+
+    // Appends value of serialized pack slot to key so
+    // that equal values give equal keys. Numbers, packs
+    // and messageables serialize as address of the slot
+    // (unique per pack), their value is read instead.
+    void appendSlotValue(templatious::TNodePtr node,
+        const std::string& serialized,std::string& out)
+    {
+        typedef LuaContextPrimitives LCP;
+        if (LCP::intNode() == node) {
+            appendBytes(*reinterpret_cast<const int*>(
+                ptrFromString(serialized)),out);
+        } else if (LCP::doubleNode() == node) {
+            double value = *reinterpret_cast<const double*>(
+                ptrFromString(serialized));
+            // -0.0 == 0.0
+            if (0.0 == value) {
+                value = 0.0;
+            }
+            appendBytes(value,out);
+        } else if (LCP::messageableStrongNode() == node) {
+            appendBytes(reinterpret_cast<const StrongMsgPtr*>(
+                ptrFromString(serialized))->get(),out);
+        } else if (LCP::messageableWeakNode() == node) {
+            appendBytes(reinterpret_cast<const WeakMsgPtr*>(
+                ptrFromString(serialized))->lock().get(),out);
+        } else if (LCP::vpackNode() == node) {
+            appendBytes(reinterpret_cast<const StrongPackPtr*>(
+                ptrFromString(serialized))->get(),out);
+        } else {
+            out += serialized;
+        }
+    }
+
+}
+
+CallbackCache::ReadyToken::ReadyToken(
+    const std::function<bool()>& func,
+    const std::weak_ptr< ReadyQueue >& queue) :
+    _func(func), _ready(false), _busy(false), _queue(queue)
+{}
+
+void CallbackCache::ReadyToken::markReady() {
+    // already queued (or detached)
+    if (_ready.exchange(true)) {
         return;
     }
 
+    auto queue = _queue.lock();
+    if (nullptr != queue) {
+        queue->push(shared_from_this());
+    }
+}
+
+CallbackCache::CallbackCache() :
+    _freeHead(-1), _liveCount(0), _cursor(0), _pass(0),
+    _ready(std::make_shared< ReadyToken::ReadyQueue >())
+{}
+
+void CallbackCache::process() {
+    ProcessBudget unlimited;
+    process(unlimited);
+}
+
+void CallbackCache::process(ProcessBudget& budget) {
+    processDrivers(budget);
+    processScheduled(budget);
+}
+
+void CallbackCache::processScheduled(ProcessBudget& budget) {
+    // only tokens ready at the start of the pass,
+    // ones marked while running wait for next one.
+    // Buffer is local (spare storage swapped in)
+    // so nested passes can't disturb it.
+    std::vector< TokenPtr > run;
+    std::swap(run,_readyRun);
+    std::swap(run,_readyCarry);
+    _ready->drain([&](TokenPtr& t) {
+        SA::add(run,std::move(t));
+    });
+
     int cnt = 0;
-    EventDriver proc;
-    std::swap(proc,_eventDriver);
-    TEMPLATIOUS_FOREACH(auto& i,proc) {
+    TEMPLATIOUS_FOREACH(auto& i,run) {
+        if (budget.exhausted()) {
+            break;
+        }
         ++cnt;
-        i.first = i.second();
+        if (nullptr == i->_func) {
+            continue;
+        }
+        if (i->_busy) {
+            // marked again while outer pass runs
+            // it, still ready for next pass
+            _ready->push(i);
+            continue;
+        }
+        // cleared before run, so enqueues during
+        // the run mark it again (exchange syncs
+        // with the marking producer)
+        i->_ready.exchange(false);
+        i->_busy = true;
+        bool keep = i->_func();
+        i->_busy = false;
+        if (!keep) {
+            // stays "ready" forever, never queued again
+            i->_ready.store(true);
+            i->_func = nullptr;
+        }
     }
 
-    SA::clear(
-        SF::filter(
-            proc,
-            [](const std::pair< bool, std::function<bool()> >& res) {
-                return !res.first;
+    int skipped = SA::size(run) - cnt;
+    if (skipped > 0) {
+        budget.defer(skipped);
+        run.erase(run.begin(),run.begin() + cnt);
+        // nested pass may have carried some too
+        TEMPLATIOUS_FOREACH(auto& i,_readyCarry) {
+            SA::add(run,std::move(i));
+        }
+        SA::clear(_readyCarry);
+        std::swap(run,_readyCarry);
+    }
+
+    SA::clear(run);
+    if (run.capacity() > _readyRun.capacity()) {
+        std::swap(run,_readyRun);
+    }
+}
+
+void CallbackCache::processDrivers(ProcessBudget& budget) {
+    if (0 == _liveCount) {
+        return;
+    }
+
+    // slots attached during this pass (appended
+    // or reused) wait for the next. Pass number is
+    // local, nested passes (from drivers) start
+    // their own and skip drivers running below.
+    // Running stamps the slot, so one a nested
+    // pass ran isn't run again by outer pass.
+    const unsigned long long pass = ++_pass;
+    int total = static_cast<int>(_slots.size());
+    if (_cursor >= total) {
+        _cursor = 0;
+    }
+
+    int idx = _cursor;
+    int visited = 0;
+    for (; visited < total; ++visited) {
+        // deque, reference survives attach
+        Slot& slot = _slots[idx];
+        if (isDue(slot,pass)) {
+            if (budget.exhausted()) {
+                break;
             }
-        )
-    );
 
-    if (SA::size(_eventDriver) == 0) {
-        std::swap(proc,_eventDriver);
+            slot._pass = pass;
+            slot._busy = true;
+            bool keep = slot._func();
+            slot._busy = false;
+            if (!keep || slot._detached) {
+                release(idx);
+            }
+        }
+        idx = idx + 1 < total ? idx + 1 : 0;
+    }
+
+    if (visited == total) {
+        return;
+    }
+
+    // drivers not reached go first next pass
+    _cursor = idx;
+    int skipped = 0;
+    for (; visited < total; ++visited) {
+        if (isDue(_slots[idx],pass)) {
+            ++skipped;
+        }
+        idx = idx + 1 < total ? idx + 1 : 0;
+    }
+    budget.defer(skipped);
+}
+
+CallbackCache::Handle CallbackCache::attach(const std::function<bool()>& func) {
+    int idx = _freeHead;
+    if (idx >= 0) {
+        _freeHead = _slots[idx]._nextFree;
+    } else {
+        idx = static_cast<int>(_slots.size());
+        _slots.emplace_back();
+    }
+
+    Slot& slot = _slots[idx];
+    slot._func = func;
+    slot._pass = _pass;
+    slot._nextFree = -1;
+    slot._live = true;
+    ++_liveCount;
+    return Handle(idx,slot._gen);
+}
+
+bool CallbackCache::detach(const Handle& handle) {
+    if (!handle.valid() || handle._index >= static_cast<int>(_slots.size())) {
+        return false;
+    }
+
+    Slot& slot = _slots[handle._index];
+    if (!slot._live || slot._gen != handle._gen) {
+        return false;
+    }
+
+    if (slot._busy) {
+        // can't destroy function that is running
+        ++slot._gen;
+        slot._detached = true;
+        return true;
+    }
+
+    release(handle._index);
+    return true;
+}
+
+bool CallbackCache::isDue(const Slot& slot,unsigned long long pass) {
+    return slot._live && !slot._busy && !slot._detached
+        && slot._pass < pass;
+}
+
+int CallbackCache::driverCount() const {
+    return _liveCount;
+}
+
+void CallbackCache::release(int index) {
+    Slot& slot = _slots[index];
+    slot._func = nullptr;
+    slot._live = false;
+    slot._detached = false;
+    ++slot._gen;
+    slot._nextFree = _freeHead;
+    _freeHead = index;
+    --_liveCount;
+}
+
+CallbackCache::TokenPtr CallbackCache::attachScheduled(
+    const std::function<bool()>& func)
+{
+    return TokenPtr(new ReadyToken(func,_ready));
+}
+
+namespace {
+
+    enum class PoolSlot {
+        Int, Double, Bool, String, Fixed, Unpoolable
+    };
+
+    PoolSlot poolSlotType(const char* type) {
+        if (0 == strcmp(type,"int")) {
+            return PoolSlot::Int;
+        } else if (0 == strcmp(type,"double")) {
+            return PoolSlot::Double;
+        } else if (0 == strcmp(type,"bool")) {
+            return PoolSlot::Bool;
+        } else if (0 == strcmp(type,"string")) {
+            return PoolSlot::String;
+        } else if (0 == strncmp(type,"vmsg_",5)
+            || 0 == strcmp(type,"vpack"))
+        {
+            // values are pointers to temporaries
+            return PoolSlot::Unpoolable;
+        }
+        // signatures and other user types
+        // are part of the key
+        return PoolSlot::Fixed;
+    }
+
+    // values as passed to factory type nodes
+    void refillPack(templatious::VirtualPack& pack,
+        int size,const char** types,const char** values)
+    {
+        TEMPLATIOUS_0_TO_N(i,size) {
+            switch (poolSlotType(types[i])) {
+                case PoolSlot::Int:
+                    pack.callSingle< int >(i,[&](int& out) {
+                        out = static_cast<int>(
+                            *reinterpret_cast<const double*>(values[i]));
+                    });
+                    break;
+                case PoolSlot::Double:
+                    pack.callSingle< double >(i,[&](double& out) {
+                        out = *reinterpret_cast<const double*>(values[i]);
+                    });
+                    break;
+                case PoolSlot::Bool:
+                    pack.callSingle< bool >(i,[&](bool& out) {
+                        out = values[i][0] == 't';
+                    });
+                    break;
+                case PoolSlot::String:
+                    pack.callSingle< std::string >(i,[&](std::string& out) {
+                        out.assign(values[i]);
+                    });
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+}
+
+void PackPool::setLimit(int perSignature) {
+    assert( perSignature >= 0 && "Negative pool limit." );
+    _perSignature = perSignature;
+    TEMPLATIOUS_FOREACH(auto& i,_buckets) {
+        auto& bucket = i.second;
+        while (SA::size(bucket) > _perSignature) {
+            bucket.pop_back();
+            --_size;
+        }
+    }
+}
+
+PackPool::Stats PackPool::stats() const {
+    Stats out = _stats;
+    out.size = _size;
+    return out;
+}
+
+bool PackPool::makeKey(int size,const char** types,const char** values) {
+    _key.clear();
+    TEMPLATIOUS_0_TO_N(i,size) {
+        switch (poolSlotType(types[i])) {
+            case PoolSlot::Unpoolable:
+                return false;
+            case PoolSlot::Fixed:
+                _key += types[i];
+                _key += '=';
+                _key += values[i];
+                break;
+            default:
+                _key += types[i];
+                break;
+        }
+        _key += '\0';
+    }
+    return true;
+}
+
+StrongPackPtr PackPool::make(
+    const templatious::DynVPackFactory& fact,
+    int size,const char** types,const char** values)
+{
+    if (0 == _perSignature || !makeKey(size,types,values)) {
+        return fact.makePack(size,types,values);
+    }
+
+    auto& bucket = _buckets[_key];
+    TEMPLATIOUS_FOREACH(auto& i,bucket) {
+        // only the pool holds it, whoever used
+        // it last released it (acq_rel decrement)
+        if (1 == i.use_count()) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            refillPack(*i,size,types,values);
+            ++_stats.hits;
+            return i;
+        }
+    }
+
+    ++_stats.misses;
+    auto p = fact.makePack(size,types,values);
+    if (SA::size(bucket) < _perSignature) {
+        SA::add(bucket,p);
+        ++_size;
+    }
+    return p;
+}
+
+CallbackSlots::CallbackSlots() :
+    _table(LUA_NOREF), _index(LUA_NOREF), _counts(1,-1)
+{}
+
+void CallbackSlots::init(lua_State* s) {
+    ::lua_newtable(s);
+    _table = ::luaL_ref(s,LUA_REGISTRYINDEX);
+    ::lua_newtable(s);
+    _index = ::luaL_ref(s,LUA_REGISTRYINDEX);
+}
+
+int CallbackSlots::ref(lua_State* s,int idx) {
+    if (::lua_isnil(s,idx)) {
+        return LUA_REFNIL;
+    }
+    int abs = ::lua_absindex(s,idx);
+
+    // same function passed again shares slot
+    ::lua_rawgeti(s,LUA_REGISTRYINDEX,_index);
+    ::lua_pushvalue(s,abs);
+    ::lua_rawget(s,-2);
+    int slot = static_cast<int>(::lua_tointeger(s,-1));
+    ::lua_pop(s,1);
+    if (slot > 0) {
+        ::lua_pop(s,1);
+        // may be waiting for flush with zero count
+        ++_counts[slot];
+        return slot;
+    }
+
+    if (!_free.empty()) {
+        slot = _free.back();
+        _free.pop_back();
     } else {
-        EventDriver another(std::move(_eventDriver));
-        std::swap(proc,_eventDriver);
-        TEMPLATIOUS_FOREACH(auto& i,another) {
-            SA::add(_eventDriver,std::move(i));
+        slot = SA::size(_counts);
+        SA::add(_counts,0);
+    }
+    _counts[slot] = 1;
+
+    ::lua_pushvalue(s,abs);
+    ::lua_pushinteger(s,slot);
+    ::lua_rawset(s,-3);
+    ::lua_pop(s,1);
+
+    ::lua_rawgeti(s,LUA_REGISTRYINDEX,_table);
+    ::lua_pushvalue(s,abs);
+    ::lua_rawseti(s,-2,slot);
+    ::lua_pop(s,1);
+    return slot;
+}
+
+void CallbackSlots::push(lua_State* s,int slot) {
+    if (slot <= 0) {
+        ::lua_pushnil(s);
+        return;
+    }
+
+    ::lua_rawgeti(s,LUA_REGISTRYINDEX,_table);
+    ::lua_rawgeti(s,-1,slot);
+    ::lua_remove(s,-2);
+}
+
+void CallbackSlots::release(int slot) {
+    if (slot <= 0) {
+        return;
+    }
+
+    assert( _counts[slot] > 0 && "Slot released too many times." );
+    if (0 == --_counts[slot]) {
+        SA::add(_released,slot);
+    }
+}
+
+void CallbackSlots::flush(lua_State* s) {
+    if (SA::size(_released) == 0) {
+        return;
+    }
+
+    ::lua_rawgeti(s,LUA_REGISTRYINDEX,_table);
+    ::lua_rawgeti(s,LUA_REGISTRYINDEX,_index);
+    TEMPLATIOUS_FOREACH(int slot,_released) {
+        // ref'd again, or listed twice and already freed
+        if (0 != _counts[slot]) {
+            continue;
         }
+        _counts[slot] = -1;
+
+        // -1 -> index, -2 -> table
+        ::lua_rawgeti(s,-2,slot);
+        ::lua_pushnil(s);
+        ::lua_rawset(s,-3);
+        ::lua_pushnil(s);
+        ::lua_rawseti(s,-3,slot);
+        SA::add(_free,slot);
     }
+    ::lua_pop(s,2);
+    SA::clear(_released);
 }
 
-void CallbackCache::attach(const std::function<bool()>& func) {
-    SA::add(_eventDriver,
-        std::pair<
-            bool, std::function< bool() >
-        >(true,func));
+int CallbackSlots::used() const {
+    return SA::size(_counts) - 1 - SA::size(_free);
 }
 
 struct VTree {
@@ -433,6 +882,7 @@ struct ContextMessageable : public Messageable {
     }
 
     friend struct LuaContextImpl;
+    friend struct LuaMessageHandler;
 
     void assertThread() {
         _g.assertThread();
@@ -657,8 +1107,7 @@ struct VMessageMT {
     // -1 -> messageable
     // -2 -> cache
     static int luanat_forwardST(lua_State* state) {
-        VMessageMT* cache = reinterpret_cast<VMessageMT*>(
-            ::lua_touserdata(state,-2));
+        VMessageMT* cache = live(state,-2);
 
         StrongMsgPtr* msg = reinterpret_cast<StrongMsgPtr*>(
             ::lua_touserdata(state,-1));
@@ -671,8 +1120,7 @@ struct VMessageMT {
     // -1 -> messageable
     // -2 -> cache
     static int luanat_forwardMT(lua_State* state) {
-        VMessageMT* cache = reinterpret_cast<VMessageMT*>(
-            ::lua_touserdata(state,-2));
+        VMessageMT* cache = live(state,-2);
 
         StrongMsgPtr* msg = reinterpret_cast<StrongMsgPtr*>(
             ::lua_touserdata(state,-1));
@@ -686,8 +1134,7 @@ struct VMessageMT {
     // -2 -> slot
     // -1 -> table
     static int luanat_setValueMT(lua_State* state) {
-        VMessageMT* cache = reinterpret_cast<VMessageMT*>(
-            ::lua_touserdata(state,-3));
+        VMessageMT* cache = live(state,-3);
 
         auto slot = ::lua_tonumber(state,-2);
         long rounded = std::lround( slot );
@@ -705,9 +1152,20 @@ private:
     friend struct LuaMessageHandler;
 
     VMessageMT(
-        const StrongPackPtr& pack,
+        StrongPackPtr pack,
         LuaContext* ctx) :
-        _pack(pack), _ctx(ctx) {}
+        _pack(std::move(pack)), _ctx(ctx) {}
+
+    // pack is released once handler returns,
+    // userdata kept by script is an error to use
+    static VMessageMT* live(lua_State* state,int idx) {
+        VMessageMT* cache = reinterpret_cast<VMessageMT*>(
+            ::lua_touserdata(state,idx));
+        if (nullptr == cache->_pack) {
+            ::luaL_error(state,"Message used after its handler returned.");
+        }
+        return cache;
+    }
 
     StrongPackPtr _pack;
     LuaContext* _ctx;
@@ -736,6 +1194,11 @@ struct LuaMessageHandler : public Messageable {
 
     void message(const StrongPackPtr& sptr) override;
 
+    bool tryMessage(const StrongPackPtr& sptr) override;
+
+    bool tryMessage(const StrongPackPtr& sptr,
+        const SendOptions& options) override;
+
     void message(templatious::VirtualPack& pack) override {
         _g.assertThread();
 
@@ -778,6 +1241,159 @@ struct LuaMessageHandler : public Messageable {
         return 1;
     }
 
+    // script argument, null if it's
+    // not a lua handler messageable
+    static std::shared_ptr< LuaMessageHandler >
+    handlerArg(lua_State* state,int idx) {
+        StrongMsgPtr* msgPtr = reinterpret_cast<StrongMsgPtr*>(
+            ::luaL_testudata(state,idx,"StrongMessageablePtr"));
+        if (nullptr == msgPtr) {
+            return nullptr;
+        }
+        return std::dynamic_pointer_cast< LuaMessageHandler >(*msgPtr);
+    }
+
+    // -1 -> overflow policy name
+    // -2 -> max queued messages, 0 for unbounded
+    // -3 -> lua handler
+    // -4 -> context
+    static int luanat_setQueueBound(lua_State* state) {
+        // script input, raise lua error instead of asserting
+        if (4 != ::lua_gettop(state)) {
+            return ::luaL_error(state,
+                "Expected handler, bound and overflow policy.");
+        }
+
+        auto hndl = handlerArg(state,-3);
+        if (nullptr == hndl) {
+            return ::luaL_error(state,"Only lua handlers can be bounded.");
+        }
+
+        if (LUA_TNUMBER != ::lua_type(state,-2)) {
+            return ::luaL_error(state,"Bound must be a number.");
+        }
+        lua_Number bound = ::lua_tonumber(state,-2);
+        if (bound < 0 || bound > std::numeric_limits<int>::max()) {
+            return ::luaL_error(state,"Bound must be in [0,%d].",
+                std::numeric_limits<int>::max());
+        }
+
+        if (LUA_TSTRING != ::lua_type(state,-1)) {
+            return ::luaL_error(state,"Overflow policy must be a string.");
+        }
+        typedef MessageCache::Overflow Overflow;
+        std::string policyName = ::lua_tostring(state,-1);
+        Overflow policy = Overflow::Reject;
+        if ("block" == policyName) {
+            policy = Overflow::Block;
+        } else if ("drop_oldest" == policyName) {
+            policy = Overflow::DropOldest;
+        } else if ("drop_newest" == policyName) {
+            policy = Overflow::DropNewest;
+        } else if ("reject" != policyName) {
+            return ::luaL_error(state,"Unknown overflow policy '%s'.",
+                policyName.c_str());
+        }
+
+        // only the handler's own context thread frees room,
+        // its sends would wait for themselves forever
+        WeakCtxPtr* ctxW = reinterpret_cast< WeakCtxPtr* >(
+            ::lua_touserdata(state,-4));
+        if (Overflow::Block == policy
+            && hndl->_ctxW.lock() == ctxW->lock())
+        {
+            return ::luaL_error(state,
+                "Handler can't block senders of its own context.");
+        }
+
+        hndl->_cache.setBound(static_cast<int>(std::lround(bound)),policy);
+        return 0;
+    }
+
+    // -1 -> table of lane budgets, lowest lane first
+    // -2 -> lua handler
+    // -3 -> context
+    static int luanat_setQueueLanes(lua_State* state) {
+        // script input, raise lua error instead of asserting
+        auto hndl = handlerArg(state,-2);
+        if (nullptr == hndl) {
+            return ::luaL_error(state,"Only lua handlers have lanes.");
+        }
+
+        if (LUA_TTABLE != ::lua_type(state,-1)) {
+            return ::luaL_error(state,"Lane budgets must be a table.");
+        }
+        int count = static_cast<int>(::lua_rawlen(state,-1));
+        if (count < 1 || count > MessageCache::MAX_LANES) {
+            return ::luaL_error(state,"Lane count must be in [1,%d].",
+                MessageCache::MAX_LANES);
+        }
+
+        int budgets[MessageCache::MAX_LANES];
+        TEMPLATIOUS_0_TO_N(i,count) {
+            ::lua_rawgeti(state,-1,i + 1);
+            long budget = std::lround(::lua_tonumber(state,-1));
+            ::lua_pop(state,1);
+            if (budget < 1) {
+                return ::luaL_error(state,"Lane budget must be positive.");
+            }
+            budgets[i] = static_cast<int>(budget);
+        }
+
+        TEMPLATIOUS_0_TO_N(i,count) {
+            hndl->_cache.setLaneBudget(i,budgets[i]);
+        }
+        hndl->_cache.setLanes(count);
+        return 0;
+    }
+
+    // -1 -> key slot, 0 for signature only
+    // -2 -> enabled
+    // -3 -> lua handler
+    // -4 -> context
+    static int luanat_setCoalescing(lua_State* state) {
+        auto hndl = handlerArg(state,-3);
+        if (nullptr == hndl) {
+            return ::luaL_error(state,"Only lua handlers can coalesce.");
+        }
+
+        bool enabled = ::lua_toboolean(state,-2) != 0;
+        int keySlot = static_cast<int>(
+            std::lround(::lua_tonumber(state,-1)));
+
+        if (!enabled) {
+            hndl->_cache.setCoalescing(nullptr);
+            return 0;
+        }
+
+        auto wCtx = hndl->_ctxW;
+        hndl->_cache.setCoalescing(
+            [=](const templatious::VirtualPack& pack,std::string& key) {
+                auto ctx = wCtx.lock();
+                if (nullptr == ctx) {
+                    return false;
+                }
+
+                auto fact = ctx->getFact();
+                templatious::TNodePtr outInf[32];
+                auto outVec = fact->serializePack(pack,outInf);
+                int outSize = SA::size(outVec);
+
+                key.clear();
+                TEMPLATIOUS_0_TO_N(i,outSize) {
+                    key += fact->associatedName(outInf[i]);
+                    key += '\0';
+                }
+
+                if (keySlot > 0 && keySlot <= outSize) {
+                    appendSlotValue(outInf[keySlot - 1],
+                        outVec[keySlot - 1],key);
+                }
+                return true;
+            });
+        return 0;
+    }
+
 private:
     void processAsyncMessages() {
         _g.assertThread();
@@ -785,14 +1401,32 @@ private:
         auto locked = _ctxW.lock();
         auto s = locked->s();
 
-        this->_cache.processPtr([=](const StrongPackPtr& pack) {
-            ::lua_rawgeti(s,_table,_funcRef);
+        // cache is done with the pack, lua
+        // userdata takes it over without a copy
+        auto handle = [&](StrongPackPtr& pack) {
+            int top = ::lua_gettop(s);
             void* buf = ::lua_newuserdata(s,sizeof(VMessageMT));
-            new (buf) VMessageMT(pack,locked.get());
+            auto msg = new (buf) VMessageMT(std::move(pack),locked.get());
             ::luaL_setmetatable(s,"VMessageMT");
-
-            handleLuaError(::lua_pcall(s,1,0,0),s);
-        });
+            // stays on stack below the call,
+            // handler may drop its own reference
+            ::lua_rawgeti(s,_table,_funcRef);
+            ::lua_pushvalue(s,-2);
+
+            int err = ::lua_pcall(s,1,0,0);
+            // handled, pack callbacks fire now instead
+            // of whenever userdata is collected
+            msg->_pack = nullptr;
+            handleLuaError(err,s);
+            ::lua_settop(s,top);
+        };
+
+        // share budget of context pass in progress
+        if (nullptr != locked->_budget) {
+            this->_cache.processPtr(handle,*locked->_budget);
+        } else {
+            this->_cache.processPtr(handle);
+        }
     }
 
     //void notifyDependency();
@@ -806,6 +1440,10 @@ private:
                 [=](GMI::AttachItselfToMessageable,const StrongMsgPtr& msg) {
                     assert( nullptr != msg && "Can't attach, dead." );
 
+                    if (attachScheduled(msg)) {
+                        return;
+                    }
+
                     auto weakCpy = _selfW;
                     std::function<bool()> func = [=]() {
                         auto locked = weakCpy.lock();
@@ -828,6 +1466,46 @@ private:
         );
     }
 
+    // Context event loop is known, so handler is
+    // only visited when something was enqueued.
+    // Other messageables get a plain driver.
+    bool attachScheduled(const StrongMsgPtr& msg) {
+        auto ctxMsg = std::dynamic_pointer_cast< ContextMessageable >(msg);
+        if (nullptr == ctxMsg) {
+            return false;
+        }
+
+        auto target = ctxMsg->_wCtx.lock();
+        assert( nullptr != target && "Context already dead?" );
+
+        auto weakCpy = _selfW;
+        auto token = target->_eventDriver.attachScheduled(
+            [=]() {
+                auto locked = weakCpy.lock();
+                if (nullptr == locked) {
+                    return false;
+                }
+
+                locked->processAsyncMessages();
+                // budget left some for later
+                if (locked->_cache.pendingCount() > 0) {
+                    locked->markReady();
+                }
+                return true;
+            });
+
+        std::atomic_store(&_readyToken,token);
+        markReady();
+        return true;
+    }
+
+    void markReady() {
+        auto token = std::atomic_load(&_readyToken);
+        if (nullptr != token) {
+            token->markReady();
+        }
+    }
+
     WeakCtxPtr _ctxW;
     std::weak_ptr< LuaMessageHandler > _selfW;
     int _table;
@@ -836,6 +1514,8 @@ private:
     ThreadGuard _g;
     MessageCache _cache;
     Handler _hndl;
+    // set if attached to context event loop
+    CallbackCache::TokenPtr _readyToken;
 
     long _lastUpdate;
 };
@@ -853,36 +1533,31 @@ struct LuaContextImpl {
             _alreadyFired(other._alreadyFired),
             _callbackExists(other._callbackExists), // for correct callback
             _failExists(other._failExists), // for error callback
-            _tableRef(other._tableRef), // for correct callback
             _funcRef(other._funcRef), // for correct callback
-            _tableRefFail(other._tableRefFail), // for error callback
             _funcRefFail(other._funcRefFail), // for error callback
             _ctx(other._ctx),
+            _deadline(other._deadline),
             _outSelfPtr(other._outSelfPtr)
         {
             *_outSelfPtr = this;
             other._alreadyFired = true;
             other._callbackExists = false;
             other._failExists = false;
-            other._tableRef = -1;
             other._funcRef = -1;
-            other._tableRefFail = -1;
             other._funcRefFail = -1;
         }
 
         AsyncCallbackStruct(
-            int tableRef,
             int funcRef,
             WeakCtxPtr ctx,
             AsyncCallbackStruct** outSelf
         ) : _alreadyFired(false),
             _callbackExists(true),
             _failExists(false),
-            _tableRef(tableRef),
             _funcRef(funcRef),
-            _tableRefFail(-1),
             _funcRefFail(-1),
             _ctx(ctx),
+            _deadline(SendOptions::Clock::time_point::max()),
             _outSelfPtr(outSelf)
         {
             *_outSelfPtr = this;
@@ -890,38 +1565,33 @@ struct LuaContextImpl {
 
         AsyncCallbackStruct(
             bool failExists,
-            int tableRef,
             int funcRef,
             WeakCtxPtr ctx,
             AsyncCallbackStruct** outSelf
         ) : _alreadyFired(false),
             _callbackExists(false),
             _failExists(true),
-            _tableRef(-1),
             _funcRef(-1),
-            _tableRefFail(tableRef),
             _funcRefFail(funcRef),
             _ctx(ctx),
+            _deadline(SendOptions::Clock::time_point::max()),
             _outSelfPtr(outSelf)
         {
             *_outSelfPtr = this;
         }
 
         AsyncCallbackStruct(
-            int tableRef,
             int funcRef,
-            int tableRefFail,
             int funcRefFail,
             WeakCtxPtr ctx,
             AsyncCallbackStruct** outSelf
         ) : _alreadyFired(false),
             _callbackExists(true),
             _failExists(true),
-            _tableRef(tableRef),
             _funcRef(funcRef),
-            _tableRefFail(tableRefFail),
             _funcRefFail(funcRefFail),
             _ctx(ctx),
+            _deadline(SendOptions::Clock::time_point::max()),
             _outSelfPtr(outSelf)
         {
             *_outSelfPtr = this;
@@ -939,12 +1609,19 @@ struct LuaContextImpl {
             assert( nullptr != ctx && "Context already dead?" );
 
             auto l = _myself.lock();
+            // Decided once here, so exactly one of the
+            // pair runs. Stale result isn't marshalled
+            // into lua, error callback fires instead.
+            bool stale =
+                _deadline != SendOptions::Clock::time_point::max()
+                && SendOptions::Clock::now() >= _deadline;
             if (_callbackExists) {
-                enqueueCallback(*ctx,_tableRef,_funcRef,true,l,_ctx);
+                enqueueCallback(*ctx,_funcRef,!stale,l,_ctx);
             }
             if (_failExists) {
-                // enqueue for destruction at home thread
-                enqueueCallback(*ctx,_tableRefFail,_funcRefFail,false,l,ctx);
+                // otherwise enqueued for destruction
+                // at home thread, fires without pack
+                enqueueCallback(*ctx,_funcRefFail,stale,nullptr,ctx);
             }
         }
 
@@ -954,10 +1631,10 @@ struct LuaContextImpl {
                 assert( nullptr != ctx && "Context already dead?" );
                 auto l = _myself.lock();
                 if (_callbackExists) {
-                    enqueueCallback(*ctx,_tableRef,_funcRef,false,l,_ctx);
+                    enqueueCallback(*ctx,_funcRef,false,l,_ctx);
                 }
                 if (_failExists) {
-                    enqueueCallback(*ctx,_tableRefFail,_funcRefFail,true,l,ctx);
+                    enqueueCallback(*ctx,_funcRefFail,true,l,ctx);
                 }
             }
         }
@@ -966,17 +1643,21 @@ struct LuaContextImpl {
             _myself = myself;
         }
 
+        void setDeadline(SendOptions::Clock::time_point deadline) {
+            _deadline = deadline;
+        }
+
     private:
         mutable bool _alreadyFired;
         // weak to prevent cycle on destruction
         bool _callbackExists;
         bool _failExists;
-        int _tableRef;
+        // slots in context's CallbackSlots
         int _funcRef;
-        int _tableRefFail;
         int _funcRefFail;
         WeakPackPtr _myself;
         WeakCtxPtr _ctx;
+        SendOptions::Clock::time_point _deadline;
 
         AsyncCallbackStruct** _outSelfPtr;
     };
@@ -1066,7 +1747,12 @@ struct LuaContextImpl {
         }
     }
 
-    static std::unique_ptr< VTree >
+    // root lives on the caller's stack, sends
+    // don't pay an extra allocation for it.
+    // Sync sends still allocate: child vector,
+    // long strings and the pack itself, which
+    // factory only makes as heap shared_ptr.
+    static VTree
     makeTreeFromTable(LuaContext& ctx,lua_State* state,int idx) {
         ctx.assertThread();
 
@@ -1074,7 +1760,7 @@ struct LuaContextImpl {
 
         getCharNodes(state,idx,nodes);
 
-        return std::unique_ptr< VTree >(new VTree("[root]",std::move(nodes)));
+        return VTree("[root]",std::move(nodes));
     }
 
     static int prepChildren(
@@ -1136,7 +1822,7 @@ struct LuaContextImpl {
 
             int size = SA::size(innerTypeNode);
             auto p = ctx._fact->makePack(size,types,values);
-            SA::add(d._bufferVPtr,p);
+            SA::add(d._bufferVPtr,std::move(p));
 
             type[idx] = VPNAME;
             value[idx] = reinterpret_cast<const char*>(
@@ -1185,11 +1871,13 @@ struct LuaContextImpl {
         }
     }
 
+    // signature, if not null, goes in as first
+    // slot ahead of the tree's own slots
     template <class T>
     static StrongPackPtr toVPack(
         LuaContext& ctx,
         VTree& tree,T&& creator,
-        StackDump& d)
+        StackDump& d,const char* signature)
     {
         assert( tree.getType() == VTree::Type::VTreeItself
             && "Expecting tree here, milky..." );
@@ -1208,13 +1896,25 @@ struct LuaContextImpl {
         assert( typeTree.getKey() == "types" );
         assert( valueTree.getKey() == "values" );
 
-        int size = prepChildren(ctx,typeTree,valueTree,types,values,d);
+        int offset = 0;
+        if (nullptr != signature) {
+            assert( SA::size(typeTree.getInnerTree()) < 32
+                && "No room left for signature." );
+            types[0] = signature;
+            values[0] = "";
+            offset = 1;
+        }
+
+        int size = prepChildren(ctx,typeTree,valueTree,
+            types + offset,values + offset,d);
 
-        return creator(size,types,values);
+        return creator(size + offset,types,values);
     }
 
     template <class Maker>
-    static StrongPackPtr treeToPack(LuaContext& ctx,VTree& tree,Maker&& m) {
+    static StrongPackPtr treeToPack(LuaContext& ctx,VTree& tree,Maker&& m,
+        const char* signature = nullptr)
+    {
         ctx.assertThread();
 
         templatious::StaticBuffer< StrongPackPtr, 32 > bufPack;
@@ -1227,7 +1927,7 @@ struct LuaContextImpl {
 
         StackDump d(vPack,vWMsg,vSMsg);
 
-        return toVPack(ctx,tree,std::forward<Maker>(m),d);
+        return toVPack(ctx,tree,std::forward<Maker>(m),d,signature);
     }
 
     struct CallbackResultWriter {
@@ -1282,13 +1982,13 @@ struct LuaContextImpl {
         ctx->assertThread();
 
         auto inTree = makeTreeFromTable(*ctx,state,-1);
-        sortVTree(*inTree);
+        sortVTree(inTree);
 
         bool outBool = false;
         bool *resPtr = &outBool;
 
         auto fact = ctx->getFact();
-        auto p = treeToPack(*ctx,*inTree,
+        auto p = treeToPack(*ctx,inTree,
             [=](int size,const char** types,const char** values) {
                 return fact->makePackWCallback(size,types,values,
                         CallbackResultWriter(resPtr));
@@ -1307,16 +2007,31 @@ struct LuaContextImpl {
         return 1;
     }
 
+    // timeout in milliseconds, zero means none
+    static void readTimeout(lua_State* state,int idx,SendOptions& options) {
+        double millis = ::lua_tonumber(state,idx);
+        if (millis > 0) {
+            options.expireAfter(std::chrono::microseconds(
+                static_cast<long long>(millis * 1000)));
+        }
+    }
+
     // -1 -> value tree
-    // -2 -> error callback, can be nil
-    // -3 -> callback
-    // -4 -> strong messageable
-    // -5 -> context
+    // -2 -> timeout millis
+    // -3 -> error callback, can be nil
+    // -4 -> callback
+    // -5 -> strong messageable
+    // -6 -> context
     static int luanat_sendPackAsyncWCallback(lua_State* state) {
         WeakCtxPtr* ctxW = reinterpret_cast< WeakCtxPtr* >(
-            ::lua_touserdata(state,-5));
+            ::lua_touserdata(state,-6));
         StrongMsgPtr* msgPtr = reinterpret_cast<
-            StrongMsgPtr*>(::lua_touserdata(state,-4));
+            StrongMsgPtr*>(::lua_touserdata(state,-5));
+
+        SendOptions options;
+        readTimeout(state,-2,options);
+        // rest of the stack as without timeout
+        ::lua_remove(state,-2);
 
         auto ctx = ctxW->lock();
         assert( nullptr != ctx && "Context already dead?" );
@@ -1324,31 +2039,30 @@ struct LuaContextImpl {
         auto& msg = *msgPtr;
         assert( nullptr != msg && "Messageable doesn't exist." );
 
-        const int TABLE_IDX = LUA_REGISTRYINDEX;
-        ::lua_pushvalue(state,-3);
-        int funcRef = ::luaL_ref(state,TABLE_IDX);
+        auto& slots = ctx->_callbackSlots;
+        int funcRef = slots.ref(state,-3);
 
         bool hasErrorHndl = LUA_TNIL != ::lua_type(state,-2);
         int funcRefFail = -1;
         if (hasErrorHndl) {
-            ::lua_pushvalue(state,-2);
-            funcRefFail = ::luaL_ref(state,TABLE_IDX);
+            funcRefFail = slots.ref(state,-2);
         }
 
         ctx->assertThread();
         auto inTree = makeTreeFromTable(*ctx,state,-1);
-        sortVTree(*inTree);
+        sortVTree(inTree);
 
         auto fact = ctx->getFact();
-        auto p = treeToPack(*ctx,*inTree,
+        auto p = treeToPack(*ctx,inTree,
             [=](int size,const char** types,const char** values) {
                 if (!hasErrorHndl) {
                     AsyncCallbackStruct* out = nullptr;
                     const int FLAGS =
                         templatious::VPACK_SYNCED;
                     auto p = fact->makePackCustomWCallback< FLAGS >(
-                        size,types,values,AsyncCallbackStruct(TABLE_IDX,funcRef,*ctxW,&out));
+                        size,types,values,AsyncCallbackStruct(funcRef,*ctxW,&out));
                     out->setMyself(p);
+                    out->setDeadline(options.deadline);
                     return p;
                 } else {
                     AsyncCallbackStruct* out = nullptr;
@@ -1356,25 +2070,39 @@ struct LuaContextImpl {
                         templatious::VPACK_SYNCED;
                     auto p = fact->makePackCustomWCallback< FLAGS >(
                         size,types,values,AsyncCallbackStruct(
-                            TABLE_IDX,funcRef,TABLE_IDX,funcRefFail,*ctxW,&out));
+                            funcRef,funcRefFail,*ctxW,&out));
                     out->setMyself(p);
+                    out->setDeadline(options.deadline);
                     return p;
                 }
             });
 
-        msg->message(p);
+        // if rejected, error callback fires
+        // once pack goes out of scope
+        bool accepted = msg->tryMessage(p,options);
+        ::lua_pushboolean(state,accepted);
 
-        return 0;
+        return 1;
     }
 
     // -1 -> value tree
-    // -2 -> error callback (could be null)
-    // -3 -> strong messageable
-    // -4 -> context
+    // -2 -> timeout millis
+    // -3 -> priority
+    // -4 -> error callback (could be null)
+    // -5 -> strong messageable
+    // -6 -> context
     static int luanat_sendPackAsync(lua_State* state) {
-        WeakCtxPtr* ctxW = reinterpret_cast<WeakCtxPtr*>(::lua_touserdata(state,-4));
+        WeakCtxPtr* ctxW = reinterpret_cast<WeakCtxPtr*>(::lua_touserdata(state,-6));
         StrongMsgPtr* msgPtr = reinterpret_cast<
-            StrongMsgPtr*>(::lua_touserdata(state,-3));
+            StrongMsgPtr*>(::lua_touserdata(state,-5));
+
+        SendOptions options;
+        readTimeout(state,-2,options);
+        options.priority = static_cast<int>(
+            std::lround(::lua_tonumber(state,-3)));
+        // rest of the stack as without priority and timeout
+        ::lua_remove(state,-2);
+        ::lua_remove(state,-2);
 
         auto ctx = ctxW->lock();
         assert( nullptr != ctx && "Context already dead?" );
@@ -1384,41 +2112,159 @@ struct LuaContextImpl {
         auto& msg = *msgPtr;
         assert( nullptr != msg && "Messageable doesn't exist." );
 
-        const int TABLE_IDX = LUA_REGISTRYINDEX;
         bool hasErrorHndl = LUA_TNIL != ::lua_type(state,-2);
         int funcRefFail = -1;
         if (hasErrorHndl) {
-            ::lua_pushvalue(state,-2);
-            funcRefFail = ::luaL_ref(state,TABLE_IDX);
+            funcRefFail = ctx->_callbackSlots.ref(state,-2);
         }
 
         auto outTree = makeTreeFromTable(*ctx,state,-1);
-        sortVTree(*outTree);
+        sortVTree(outTree);
         auto fact = ctx->getFact();
-        auto p = treeToPack(*ctx,*outTree,
+        auto p = treeToPack(*ctx,outTree,
             [=](int size,const char** types,const char** values)
              -> StrongPackPtr
             {
                 if (!hasErrorHndl) {
-                    return fact->makePack(size,types,values);
+                    return ctx->_packPool.make(*fact,size,types,values);
                 } else {
                     AsyncCallbackStruct* out = nullptr;
                     const int FLAGS =
                         templatious::VPACK_SYNCED;
                     auto p = fact->makePackCustomWCallback< FLAGS >(
                         size,types,values,AsyncCallbackStruct(
-                            true,TABLE_IDX,funcRefFail,*ctxW,&out));
+                            true,funcRefFail,*ctxW,&out));
                     out->setMyself(p);
                     return p;
                 }
             });
 
-        msg->message(p);
+        // if rejected, error callback fires
+        // once pack goes out of scope
+        bool accepted = msg->tryMessage(p,options);
+        ::lua_pushboolean(state,accepted);
 
-        return 0;
+        return 1;
     }
 
-    // -1 -> value tree
+    // unrefs lua value once last copy is gone
+    struct LuaRefHolder {
+        LuaRefHolder(const WeakCtxPtr& ctx,int table,int ref) :
+            _ctx(ctx), _table(table), _ref(ref) {}
+
+        LuaRefHolder(const LuaRefHolder&) = delete;
+
+        ~LuaRefHolder() {
+            // context may be dying already
+            auto locked = _ctx.lock();
+            if (nullptr != locked) {
+                ::luaL_unref(locked->s(),_table,_ref);
+            }
+        }
+
+        WeakCtxPtr _ctx;
+        int _table;
+        int _ref;
+    };
+
+    static std::chrono::steady_clock::duration millisToDuration(double millis) {
+        return std::chrono::microseconds(
+            static_cast<long long>(millis * 1000));
+    }
+
+    // -1 -> value tree, ignored for functions
+    // -2 -> target, function or strong messageable
+    // -3 -> period millis, 0 for single shot
+    // -4 -> delay millis
+    // -5 -> context
+    static int luanat_scheduleTimer(lua_State* state) {
+        WeakCtxPtr* ctxW = reinterpret_cast<WeakCtxPtr*>(::lua_touserdata(state,-5));
+
+        auto ctx = ctxW->lock();
+        assert( nullptr != ctx && "Context already dead?" );
+
+        ctx->assertThread();
+
+        auto delay = millisToDuration(::lua_tonumber(state,-4));
+        auto period = millisToDuration(::lua_tonumber(state,-3));
+
+        // timer is dropped once target is dead
+        auto id = std::make_shared< TimerWheel::TimerId >(0);
+        WeakCtxPtr weakCtx = *ctxW;
+        std::function<void()> fire;
+        if (LUA_TFUNCTION == ::lua_type(state,-2)) {
+            const int TABLE_IDX = LUA_REGISTRYINDEX;
+            ::lua_pushvalue(state,-2);
+            auto ref = std::make_shared< LuaRefHolder >(
+                weakCtx,TABLE_IDX,::luaL_ref(state,TABLE_IDX));
+            fire = [=]() {
+                auto locked = weakCtx.lock();
+                if (nullptr == locked) {
+                    return;
+                }
+                auto s = locked->s();
+                ::lua_rawgeti(s,ref->_table,ref->_ref);
+                handleLuaError(::lua_pcall(s,0,0,0),s);
+            };
+        } else {
+            StrongMsgPtr* msgPtr = reinterpret_cast<
+                StrongMsgPtr*>(::lua_touserdata(state,-2));
+            assert( nullptr != *msgPtr && "Messageable doesn't exist." );
+
+            auto tree = std::make_shared< VTree >(
+                makeTreeFromTable(*ctx,state,-1));
+            sortVTree(*tree);
+            // tree points to userdata held by value
+            // table, keep it as long as the timer
+            const int TABLE_IDX = LUA_REGISTRYINDEX;
+            ::lua_pushvalue(state,-1);
+            auto pin = std::make_shared< LuaRefHolder >(
+                weakCtx,TABLE_IDX,::luaL_ref(state,TABLE_IDX));
+
+            WeakMsgPtr weakMsg = *msgPtr;
+            fire = [weakMsg,weakCtx,tree,pin,id]() {
+                auto lockedCtx = weakCtx.lock();
+                if (nullptr == lockedCtx) {
+                    return;
+                }
+                auto locked = weakMsg.lock();
+                if (nullptr == locked) {
+                    lockedCtx->cancelTimer(*id);
+                    return;
+                }
+                // new pack every firing, receiver may
+                // still read or change the previous one
+                auto fact = lockedCtx->getFact();
+                auto p = treeToPack(*lockedCtx,*tree,
+                    [=](int size,const char** types,const char** values) {
+                        return fact->makePack(size,types,values);
+                    });
+                locked->message(p);
+            };
+        }
+
+        *id = ctx->schedule(delay,period,fire);
+        ::lua_pushnumber(state,static_cast<lua_Number>(*id));
+        return 1;
+    }
+
+    // -1 -> timer handle
+    // -2 -> context
+    static int luanat_cancelTimer(lua_State* state) {
+        WeakCtxPtr* ctxW = reinterpret_cast<WeakCtxPtr*>(::lua_touserdata(state,-2));
+
+        auto ctx = ctxW->lock();
+        assert( nullptr != ctx && "Context already dead?" );
+
+        ctx->assertThread();
+
+        auto id = static_cast< TimerWheel::TimerId >(
+            std::llround(::lua_tonumber(state,-1)));
+        ::lua_pushboolean(state,ctx->cancelTimer(id));
+        return 1;
+    }
+
+    // -1 -> value tree
     // -2 -> strong messageable
     // -3 -> context
     static int luanat_sendPack(lua_State* state) {
@@ -1435,11 +2281,11 @@ struct LuaContextImpl {
         assert( nullptr != msg && "Messageable doesn't exist." );
 
         auto outTree = makeTreeFromTable(*ctx,state,-1);
-        sortVTree(*outTree);
+        sortVTree(outTree);
         auto fact = ctx->getFact();
         bool outRes = false;
         bool *resPtr = &outRes;
-        auto p = treeToPack(*ctx,*outTree,
+        auto p = treeToPack(*ctx,outTree,
             [=](int size,const char** types,const char** values) {
                 return fact->makePackWCallback(size,types,values,
                     CallbackResultWriter(resPtr));
@@ -1451,6 +2297,73 @@ struct LuaContextImpl {
         return 1;
     }
 
+    // Signature of a prebound stub, made once
+    // when stub is created and kept as its upvalue.
+    struct PreboundSignature {
+        PreboundSignature(const char* name) : _name(name) {}
+
+        std::string _name;
+    };
+
+    // -1 -> signature name
+    static int luanat_makePrebound(lua_State* state) {
+        if (LUA_TSTRING != ::lua_type(state,-1)) {
+            return ::luaL_error(state,"Signature name expected.");
+        }
+        const char* name = ::lua_tostring(state,-1);
+
+        void* buf = ::lua_newuserdata(state,sizeof(PreboundSignature));
+        new (buf) PreboundSignature(name);
+        ::luaL_setmetatable(state,"PreboundSignature");
+        return 1;
+    }
+
+    // -1 -> prebound signature
+    static int luanat_freePrebound(lua_State* state) {
+        PreboundSignature* sig = reinterpret_cast<PreboundSignature*>(
+            ::lua_touserdata(state,-1));
+        sig->~PreboundSignature();
+        return 0;
+    }
+
+    // -1 -> value tree (payload only)
+    // -2 -> prebound signature
+    // -3 -> strong messageable
+    // -4 -> context
+    static int luanat_sendPackPrebound(lua_State* state) {
+        WeakCtxPtr* ctxW = reinterpret_cast<WeakCtxPtr*>(::lua_touserdata(state,-4));
+        StrongMsgPtr* msgPtr = reinterpret_cast<
+            StrongMsgPtr*>(::lua_touserdata(state,-3));
+        PreboundSignature* sig = reinterpret_cast<PreboundSignature*>(
+            ::lua_touserdata(state,-2));
+
+        auto ctx = ctxW->lock();
+        assert( nullptr != ctx && "Context already dead?" );
+
+        ctx->assertThread();
+
+        auto& msg = *msgPtr;
+        assert( nullptr != msg && "Messageable doesn't exist." );
+
+        auto outTree = makeTreeFromTable(*ctx,state,-1);
+        sortVTree(outTree);
+
+        auto fact = ctx->getFact();
+        bool outRes = false;
+        bool *resPtr = &outRes;
+        auto p = treeToPack(*ctx,outTree,
+            [=](int size,const char** types,const char** values) {
+                return fact->makePackWCallback(size,types,values,
+                    CallbackResultWriter(resPtr));
+            },
+            sig->_name.c_str());
+
+        msg->message(*p);
+
+        ::lua_pushboolean(state,outRes);
+        return 1;
+    }
+
     static VTree packToTree(LuaContext& ctx,const templatious::VirtualPack& pack) {
         typedef std::vector< VTree > TreeVec;
         VTree root("[root]",TreeVec());
@@ -1533,19 +2446,87 @@ struct LuaContextImpl {
     }
 
     static void processMessages(LuaContext& ctx) {
-        std::vector< AsyncCallbackMessage > steal;
-        {
-            LuaContext::Guard g(ctx._mtx);
-            if (ctx._callbacks.size() > 0) {
-                steal = std::move(ctx._callbacks);
+        ProcessBudget unlimited;
+        processMessages(ctx,unlimited);
+    }
+
+    static void processMessages(LuaContext& ctx,ProcessBudget& budget) {
+        // cleared before draining, anything
+        // enqueued from now on notifies again.
+        // Fd is read before the flag is reset, the
+        // other way around a producer could signal in
+        // between, have it swallowed and leave the flag
+        // set, so the fd would never be signaled again.
+        // Worst case now is a spurious wake.
+        clearWakeup(ctx);
+        ctx._updatePending.store(false);
+
+        // timers first, messages they send
+        // are handled in the same pass
+        ctx._timers.advance(std::chrono::steady_clock::now());
+
+        // nested passes restore outer budget
+        ProcessBudget* outer = ctx._budget;
+        ctx._budget = std::addressof(budget);
+
+        // leftovers from previous pass go first,
+        // collect as many as budget may allow
+        auto& backlog = ctx._callbackBacklog;
+        std::vector< AsyncCallbackMessage > batch;
+        std::swap(batch,ctx._callbackBatch);
+        int allowed = budget.remaining();
+        auto fits = [&]() {
+            return allowed < 0 || SA::size(batch) < allowed;
+        };
+        while (!backlog.empty() && fits()) {
+            batch.emplace_back(std::move(backlog.front()));
+            backlog.pop_front();
+        }
+
+        ctx._callbacks.drain([&](AsyncCallbackMessage& i) {
+            // unused half of success/fail pair,
+            // released right away, costs no budget
+            if (!i.shouldCall()) {
+                AsyncCallbackMessage released(std::move(i));
+                return;
+            }
+            if (!backlog.empty() || !fits()) {
+                backlog.emplace_back(std::move(i));
+                return;
             }
+            batch.emplace_back(std::move(i));
+        });
+
+        int reached = dispatchAsyncCallbacks(ctx,batch);
+
+        // async control messages, drivers
+        // they attach run in this pass
+        auto ctxMsg = ctx._contextMsg.lock();
+        if (nullptr != ctxMsg) {
+            processMessages(*ctxMsg);
+        }
+
+        // not reached (time ran out), keep order
+        for (int i = SA::size(batch) - 1; i >= reached; --i) {
+            backlog.emplace_front(std::move(batch[i]));
         }
+        SA::clear(batch);
+        std::swap(batch,ctx._callbackBatch);
 
-        TEMPLATIOUS_FOREACH(auto& i,steal) {
-            processSingleAsyncCallback(ctx,i);
+        if (!backlog.empty()) {
+            budget.defer(SA::size(backlog));
         }
 
-        ctx._eventDriver.process();
+        ctx._eventDriver.process(budget);
+        ctx._budget = outer;
+
+        // unrefs of callbacks destroyed this pass
+        ctx._callbackSlots.flush(ctx._s);
+
+        // budget left work behind, wake loop again
+        if (budget.deferred() > 0) {
+            signalWakeup(ctx);
+        }
     }
 
     static void appendToEventDriver(LuaContext& ctx,std::function<bool()>& func) {
@@ -1554,36 +2535,94 @@ struct LuaContextImpl {
 
     static void enqueueCallback(
             LuaContext& ctx,
-            int table,
             int func,
             bool call,
             const StrongPackPtr& pack,
             const WeakCtxPtr& wCtx)
     {
-        {
-            LuaContext::Guard g(ctx._mtx);
-            ctx._callbacks.emplace_back(table,func,call,pack,wCtx);
-        }
+        ctx._callbacks.push(AsyncCallbackMessage(func,call,pack,wCtx));
         notifyDependency(wCtx);
     }
 
-    static void processSingleAsyncCallback(
+    // One protected call into lua dispatcher which
+    // pulls callbacks through nat_nextAsyncCallback.
+    // Error in a callback unwinds the dispatcher, it
+    // is then restarted after the failed callback.
+    // Returns count of callbacks reached.
+    static int dispatchAsyncCallbacks(
         LuaContext& ctx,
-        AsyncCallbackMessage& msg)
+        std::vector< AsyncCallbackMessage >& batch)
     {
-        if (msg.shouldCall()) {
-            ::lua_rawgeti(ctx._s,msg.tableRef(),msg.funcRef());
-            auto msgP = msg.pack();
-            if (nullptr != msgP) {
-                auto vtree = LuaContextImpl::packToTree(ctx,*msgP);
-                VTreeBind::pushVTree(ctx._s,std::move(vtree));
-                handleLuaError(::lua_pcall(ctx._s,1,0,0),ctx._s);
-            } else {
-                handleLuaError(::lua_pcall(ctx._s,0,0,0),ctx._s);
+        if (SA::size(batch) == 0) {
+            return 0;
+        }
+
+        // nested passes from callbacks get their own
+        auto outerBatch = ctx._dispatchBatch;
+        int outerPos = ctx._dispatchPos;
+        ctx._dispatchBatch = std::addressof(batch);
+        ctx._dispatchPos = 0;
+        auto s = ctx._s;
+        int pos = 0;
+        while (ctx._dispatchPos < SA::size(batch)) {
+            pos = ctx._dispatchPos;
+            ::lua_getglobal(s,"__dispatchAsyncCallbacks");
+            int res = ::lua_pcall(s,0,0,0);
+            if (0 == res) {
+                break;
+            }
+
+            handleLuaError(res,s);
+            ::lua_pop(s,1);
+            // dispatcher itself is broken
+            if (pos == ctx._dispatchPos) {
+                break;
             }
         }
+
+        int reached = ctx._dispatchPos;
+        ctx._dispatchBatch = outerBatch;
+        ctx._dispatchPos = outerPos;
+        return reached;
     }
 
+    // -1 -> context
+    // returns next callback and its argument if
+    // any, nothing when batch is done
+    static int luanat_nextAsyncCallback(lua_State* state) {
+        WeakCtxPtr* ctxW = reinterpret_cast<WeakCtxPtr*>(::lua_touserdata(state,-1));
+        auto ctx = ctxW->lock();
+        assert( nullptr != ctx && "Context dead?" );
+
+        auto batch = ctx->_dispatchBatch;
+        if (nullptr == batch) {
+            return 0;
+        }
+
+        auto budget = ctx->_budget;
+        while (ctx->_dispatchPos < SA::size(*batch)) {
+            auto& msg = (*batch)[ctx->_dispatchPos];
+            if (!msg.shouldCall()) {
+                ++ctx->_dispatchPos;
+                continue;
+            }
+
+            if (nullptr != budget && !budget->take()) {
+                return 0;
+            }
+            ++ctx->_dispatchPos;
+
+            ctx->_callbackSlots.push(state,msg.funcRef());
+            const auto& msgP = msg.pack();
+            if (nullptr == msgP) {
+                return 1;
+            }
+            auto vtree = LuaContextImpl::packToTree(*ctx,*msgP);
+            VTreeBind::pushVTree(state,std::move(vtree));
+            return 2;
+        }
+        return 0;
+    }
 
     static void initContextFunc(const std::shared_ptr< LuaContext >& ctx);
     static void initContext(
@@ -1591,14 +2630,108 @@ struct LuaContextImpl {
         const char* luaPlumbingFile
     );
 
+    static void signalWakeup(LuaContext& ctx) {
+        // pairs with parked counter increment in run
+        if (ctx._parked.load() > 0) {
+            std::lock_guard< std::mutex > g(ctx._parkMtx);
+            ctx._parkCond.notify_all();
+        }
+#ifdef __linux__
+        int fd = ctx._wakeFd.load();
+        if (fd >= 0) {
+            uint64_t one = 1;
+            ssize_t res = ::write(fd,&one,sizeof(one));
+            (void)res; // counter overflow is still readable
+        }
+#endif
+    }
+
+    static void clearWakeup(LuaContext& ctx) {
+#ifdef __linux__
+        int fd = ctx._wakeFd.load();
+        if (fd >= 0) {
+            uint64_t val;
+            ssize_t res = ::read(fd,&val,sizeof(val));
+            (void)res; // EAGAIN if nothing was signaled
+        }
+#endif
+    }
+
+    // true if stopped
+    static bool runUntil(LuaContext& ctx,
+        std::chrono::steady_clock::time_point deadline)
+    {
+        typedef std::chrono::steady_clock Clock;
+        auto hasWork = [&]() {
+            return ctx._updatePending.load() || ctx._stopRequested.load();
+        };
+
+        while (!ctx._stopRequested.load()) {
+            processMessages(ctx);
+
+            auto now = Clock::now();
+            if (now >= deadline) {
+                break;
+            }
+
+            // wake up for next timer too
+            auto wakeAt = deadline;
+            auto timer = ctx._timers.untilNext(now);
+            if (timer != Clock::duration::max() && deadline - now > timer) {
+                wakeAt = now + timer;
+            }
+            const bool forever = wakeAt == Clock::time_point::max();
+
+            auto spinUntil = wakeAt - now > ctx._spinDuration ?
+                now + ctx._spinDuration : wakeAt;
+            while (!hasWork() && Clock::now() < spinUntil) {
+                std::this_thread::yield();
+            }
+            if (hasWork()) {
+                continue;
+            }
+
+            std::unique_lock< std::mutex > l(ctx._parkMtx);
+            ctx._parked.fetch_add(1);
+            if (forever) {
+                ctx._parkCond.wait(l,hasWork);
+            } else {
+                ctx._parkCond.wait_until(l,wakeAt,hasWork);
+            }
+            ctx._parked.fetch_sub(1);
+        }
+
+        return ctx._stopRequested.exchange(false);
+    }
+
     static void setDependency(LuaContext& ctx,WeakMsgPtr wmsg) {
         ctx._updateDependency = wmsg;
+        ctx._updatePending.store(false);
+    }
+
+    // max if no timers are pending
+    static std::chrono::steady_clock::duration
+        untilNextTimer(LuaContext& ctx)
+    {
+        return ctx._timers.untilNext(std::chrono::steady_clock::now());
     }
 
+    // only first notification after processing
+    // pass starts goes through, rest are absorbed
     static void notifyDependency(const WeakCtxPtr& wCtx) {
         typedef GenericMessageableInterface GMI;
 
+        // handlers outlive their context, ie. once
+        // pool or scheduler was stopped
         auto locked = wCtx.lock();
+        if (nullptr == locked) {
+            return;
+        }
+        if (locked->_updatePending.exchange(true)) {
+            return;
+        }
+        signalWakeup(*locked);
+
         auto notify = locked->_updateDependency.lock();
         if (nullptr == notify) {
             return;
@@ -1628,8 +2761,26 @@ struct LuaContextImpl {
 };
 
 void LuaMessageHandler::message(const StrongPackPtr& sptr) {
-    _cache.enqueue(sptr);
+    tryMessage(sptr);
+}
+
+bool LuaMessageHandler::tryMessage(const StrongPackPtr& sptr) {
+    return tryMessage(sptr,SendOptions());
+}
+
+bool LuaMessageHandler::tryMessage(
+    const StrongPackPtr& sptr,const SendOptions& options)
+{
+    // nobody would ever process it
+    if (_ctxW.expired()) {
+        return false;
+    }
+    if (!_cache.enqueue(sptr,options)) {
+        return false;
+    }
+    markReady();
     LuaContextImpl::notifyDependency(_ctxW);
+    return true;
 }
 
 namespace VTreeBind {
@@ -1738,9 +2889,9 @@ int luanat_testVtree(lua_State* state) {
 
     auto ctx = ctxW->lock();
     auto outTree = LuaContextImpl::makeTreeFromTable(*ctx,state,-1);
-    sortVTree(*outTree);
+    sortVTree(outTree);
 
-    pushVTree(state,std::move(*outTree));
+    pushVTree(state,std::move(outTree));
     return 1;
 }
 
@@ -1860,6 +3011,24 @@ int luanat_getMessageableStrongRef(lua_State* state) {
     return 1;
 }
 
+// -1 -> strong messageable
+// -2 -> name
+// -3 -> weak ctx
+int luanat_exposeMessageable(lua_State* state) {
+    WeakCtxPtr* ctxW = reinterpret_cast<WeakCtxPtr*>(
+        ::lua_touserdata(state,-3));
+    const char* name = ::lua_tostring(state,-2);
+    StrongMsgPtr* msgPtr = reinterpret_cast<StrongMsgPtr*>(
+        ::lua_touserdata(state,-1));
+
+    auto ctx = ctxW->lock();
+    assert( nullptr != ctx && "Context already dead?" );
+    assert( nullptr != name && "Name must be string." );
+
+    ctx->addMessageableStrong(name,*msgPtr);
+    return 0;
+}
+
 }
 
 void registerNullMessageable(lua_State* state,const char* name) {
@@ -1938,6 +3107,13 @@ void registerVMessageST(lua_State* state) {
     ::lua_pop(state,1);
 }
 
+void registerPreboundSignature(lua_State* state) {
+    ::luaL_newmetatable(state,"PreboundSignature");
+    ::lua_pushcfunction(state,&LuaContextImpl::luanat_freePrebound);
+    ::lua_setfield(state,-2,"__gc");
+    ::lua_pop(state,1);
+}
+
 void registerVMessageMT(lua_State* state) {
     ::luaL_newmetatable(state,"VMessageMT");
     ::lua_pushcfunction(state,&VMessageMT::luanat_gc);
@@ -2009,6 +3185,8 @@ auto ContextMessageable::genHandler() -> VmfPtr {
             [=](GMI::InAttachToEventLoop,std::function<bool()>& func) {
                 auto locked = this->_wCtx.lock();
                 LuaContextImpl::appendToEventDriver(*locked,func);
+                // new driver runs from next pass on
+                LuaContextImpl::notifyDependency(this->_wCtx);
             }
         )
     );
@@ -2023,6 +3201,7 @@ ContextMessageable::ContextMessageable(
 
 void ContextMessageable::message(const StrongPackPtr& pack) {
     _cache.enqueue(pack);
+    LuaContextImpl::notifyDependency(_wCtx);
 }
 
 LuaMessageHandler::LuaMessageHandler(const WeakCtxPtr& wptr,int table,int func) :
@@ -2033,13 +3212,32 @@ LuaMessageHandler::LuaMessageHandler(const WeakCtxPtr& wptr,int table,int func)
 
 LuaContext::LuaContext() :
     _fact(nullptr),
-    _s(luaL_newstate())
+    _s(luaL_newstate()),
+    _dispatchBatch(nullptr),
+    _dispatchPos(0),
+    _budget(nullptr),
+    _updatePending(false),
+    _wakeFd(-1),
+    _stopRequested(false),
+    _parked(0),
+    _spinDuration(std::chrono::microseconds(50))
 {
     registerNullMessageable(_s,"__vmsgNull");
 }
 
 LuaContext::~LuaContext() {
+    // undelivered completions go before the state,
+    // their slots die with it (nothing to release)
+    _callbacks.drain([](AsyncCallbackMessage&) {});
+    _callbackBacklog.clear();
+    _callbackBatch.clear();
     ::lua_close(_s);
+#ifdef __linux__
+    int fd = _wakeFd.load();
+    if (fd >= 0) {
+        ::close(fd);
+    }
+#endif
 }
 
 void LuaContext::assertThread() const {
@@ -2136,12 +3334,92 @@ void LuaContext::processMessages() {
     LuaContextImpl::processMessages(*this);
 }
 
+PackPool::Stats LuaContext::packPoolStats() const {
+    return _packPool.stats();
+}
+
+void LuaContext::run() {
+    assertThread();
+    LuaContextImpl::runUntil(*this,
+        std::chrono::steady_clock::time_point::max());
+}
+
+bool LuaContext::runFor(std::chrono::steady_clock::duration timeout) {
+    assertThread();
+    return LuaContextImpl::runUntil(*this,
+        std::chrono::steady_clock::now() + timeout);
+}
+
+void LuaContext::stop() {
+    _stopRequested.store(true);
+    std::lock_guard< std::mutex > g(_parkMtx);
+    _parkCond.notify_all();
+}
+
+void LuaContext::setSpinDuration(std::chrono::steady_clock::duration spin) {
+    _spinDuration = spin;
+}
+
+int LuaContext::wakeupFd() {
+    assertThread();
+#ifdef __linux__
+    int fd = _wakeFd.load();
+    if (fd < 0) {
+        fd = ::eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+        assert( fd >= 0 && "Couldn't create eventfd." );
+        _wakeFd.store(fd);
+        // work may already be pending
+        if (_updatePending.load()) {
+            LuaContextImpl::signalWakeup(*this);
+        }
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+TimerWheel::TimerId LuaContext::schedule(
+    std::chrono::steady_clock::duration delay,
+    std::chrono::steady_clock::duration period,
+    const std::function<void()>& func)
+{
+    assertThread();
+    return _timers.schedule(delay,period,func);
+}
+
+bool LuaContext::cancelTimer(TimerWheel::TimerId id) {
+    assertThread();
+    return _timers.cancel(id);
+}
+
+void LuaContext::setPackPoolLimit(int perSignature) {
+    assertThread();
+    _packPool.setLimit(perSignature);
+}
+
+int LuaContext::processMessages(int maxMessages,
+    std::chrono::steady_clock::duration maxDuration)
+{
+    ProcessBudget budget(maxMessages,maxDuration);
+    LuaContextImpl::processMessages(*this,budget);
+    return budget.deferred();
+}
+
 AsyncCallbackMessage::~AsyncCallbackMessage() {
+    // empty or moved from
+    if (_funcRef <= 0) {
+        return;
+    }
+
+    // context being destroyed, its lua
+    // state and slots go away anyway
     auto locked = _ctx.lock();
-    assert( nullptr != locked && "Context already dead?" );
+    if (nullptr == locked) {
+        return;
+    }
 
-    lua_State* s = locked->s();
-    ::luaL_unref(s,_tableRef,_funcRef);
+    locked->_callbackSlots.release(_funcRef);
 }
 
 
@@ -2158,8 +3436,7 @@ int VMessageST::luanat_getValTree(lua_State* state) {
 
 // -1 -> VMessageMT
 int VMessageMT::luanat_getValTree(lua_State* state) {
-    VMessageMT* cache = reinterpret_cast<VMessageMT*>(
-        ::lua_touserdata(state,-1));
+    VMessageMT* cache = live(state,-1);
 
     VTreeBind::pushVTree(state,
         LuaContextImpl::packToTree(*cache->_ctx,*cache->_pack));
@@ -2176,13 +3453,22 @@ void LuaContextImpl::initContextFunc(const std::shared_ptr< LuaContext >& ctx) {
     ::lua_pushcfunction(s,&luanat_freeWeakLuaContext);
     ::lua_setfield(s,-2,"__gc");
 
-    ::lua_createtable(s,4,0);
+    ::lua_createtable(s,5,0);
     ::lua_pushcfunction(s,
         &LuaContextBind::luanat_getMessageableStrongRef);
     ::lua_setfield(s,-2,"namedMessageable");
+    ::lua_pushcfunction(s,
+        &LuaContextBind::luanat_exposeMessageable);
+    ::lua_setfield(s,-2,"exposeMessageable");
     ::lua_pushcfunction(s,
         &LuaMessageHandler::luanat_makeLuaHandler);
     ::lua_setfield(s,-2,"makeLuaHandler");
+    ::lua_pushcfunction(s,
+        &LuaMessageHandler::luanat_setQueueBound);
+    ::lua_setfield(s,-2,"setQueueBound");
+    ::lua_pushcfunction(s,
+        &LuaMessageHandler::luanat_setQueueLanes);
+    ::lua_setfield(s,-2,"setQueueLanes");
     ::lua_setfield(s,-2,"__index");
 
     ::lua_setmetatable(s,-2);
@@ -2195,15 +3481,28 @@ void LuaContextImpl::initContext(
 {
     auto s = ctx->s();
     luaL_openlibs(s);
+    ctx->_callbackSlots.init(s);
 
     ctx->regFunction("nat_sendPack",
         &LuaContextImpl::luanat_sendPack);
+    ctx->regFunction("nat_sendPackPrebound",
+        &LuaContextImpl::luanat_sendPackPrebound);
+    ctx->regFunction("nat_makePrebound",
+        &LuaContextImpl::luanat_makePrebound);
+    ctx->regFunction("nat_setCoalescing",
+        &LuaMessageHandler::luanat_setCoalescing);
     ctx->regFunction("nat_sendPackWCallback",
         &LuaContextImpl::luanat_sendPackWCallback);
     ctx->regFunction("nat_sendPackAsync",
         &LuaContextImpl::luanat_sendPackAsync);
     ctx->regFunction("nat_sendPackAsyncWCallback",
         &LuaContextImpl::luanat_sendPackAsyncWCallback);
+    ctx->regFunction("nat_scheduleTimer",
+        &LuaContextImpl::luanat_scheduleTimer);
+    ctx->regFunction("nat_cancelTimer",
+        &LuaContextImpl::luanat_cancelTimer);
+    ctx->regFunction("nat_nextAsyncCallback",
+        &LuaContextImpl::luanat_nextAsyncCallback);
     ctx->regFunction("nat_areMessageablesEqual",
         &LuaContextImpl::luanat_areMessageablesEqual);
     ctx->regFunction("nat_testVTree",
@@ -2215,6 +3514,7 @@ void LuaContextImpl::initContext(
 
     auto msg = std::make_shared< ContextMessageable >(ctx);
     msg->_wMsg = msg;
+    ctx->_contextMsg = msg;
     ctx->addMessageableStrong("context",msg);
 
     bool success = luaL_dofile(s,luaPlumbingFile) == 0;
@@ -2226,6 +3526,7 @@ void LuaContextImpl::initContext(
     registerVTree(s);
     registerVMessageST(s);
     registerVMessageMT(s);
+    registerPreboundSignature(s);
     registerStrongMessageable(s);
     registerWeakMessageable(s);
 
@@ -2304,3 +3605,525 @@ void NotifierCache::notify(const StrongPackPtr& msg) {
         )
     );
 }
+
+ShardRouter::ShardRouter(const templatious::DynVPackFactory* fact,
+    const std::vector< StrongMsgPtr >& targets,int keySlot) :
+    _fact(fact), _targets(targets), _keySlot(keySlot)
+{
+    assert( SA::size(_targets) > 0 && "Router needs shards." );
+    assert( keySlot > 0 && "Key slot counts from 1." );
+}
+
+void ShardRouter::message(const StrongPackPtr& msg) {
+    _targets[shardFor(*msg)]->message(msg);
+}
+
+void ShardRouter::message(templatious::VirtualPack& msg) {
+    _targets[shardFor(msg)]->message(msg);
+}
+
+bool ShardRouter::tryMessage(const StrongPackPtr& msg) {
+    return _targets[shardFor(*msg)]->tryMessage(msg);
+}
+
+bool ShardRouter::tryMessage(const StrongPackPtr& msg,
+    const SendOptions& options)
+{
+    return _targets[shardFor(*msg)]->tryMessage(msg,options);
+}
+
+int ShardRouter::shardFor(const templatious::VirtualPack& pack) const {
+    templatious::TNodePtr outInf[32];
+    auto outVec = _fact->serializePack(pack,outInf);
+    int outSize = SA::size(outVec);
+    if (_keySlot > outSize) {
+        return 0;
+    }
+
+    // hash the value, serialized numbers are
+    // addresses inside this particular pack
+    std::string key;
+    appendSlotValue(outInf[_keySlot - 1],outVec[_keySlot - 1],key);
+    std::size_t hash = std::hash< std::string >()(key);
+    return static_cast<int>(hash % SA::size(_targets));
+}
+
+LuaContextPool::LuaContextPool(int shards,
+    templatious::DynVPackFactory* fact,
+    const std::vector< std::string >& scripts,
+    const Setup& setup,
+    const char* luaPlumbingFile) :
+    _fact(fact), _shards(shards)
+{
+    assert( shards > 0 && "Pool needs at least one shard." );
+
+    std::mutex mtx;
+    std::condition_variable cond;
+    int started = 0;
+    // first shard setup failure, rethrown here
+    std::exception_ptr failure;
+
+    std::string plumbing(luaPlumbingFile);
+    TEMPLATIOUS_0_TO_N(i,shards) {
+        _threads.emplace_back([&,i,plumbing]() {
+            // created and destroyed on its own thread
+            std::shared_ptr< LuaContext > ctx;
+            try {
+                ctx = LuaContext::makeContext(plumbing.c_str());
+                ctx->setFactory(fact);
+                TEMPLATIOUS_FOREACH(auto& script,scripts) {
+                    ctx->doFile(script.c_str());
+                }
+                if (nullptr != setup) {
+                    setup(*ctx,i);
+                }
+            } catch (...) {
+                // counts as started, constructor
+                // shouldn't wait for it forever
+                std::lock_guard< std::mutex > g(mtx);
+                if (nullptr == failure) {
+                    failure = std::current_exception();
+                }
+                ++started;
+                cond.notify_one();
+                return;
+            }
+
+            {
+                // notified under lock, constructor
+                // (and locals above) may be gone after
+                std::lock_guard< std::mutex > g(mtx);
+                _shards[i] = ctx;
+                ++started;
+                cond.notify_one();
+            }
+
+            ctx->run();
+        });
+    }
+
+    std::unique_lock< std::mutex > l(mtx);
+    cond.wait(l,[&]() { return started == shards; });
+    l.unlock();
+
+    // destructor won't run, wind down
+    // shards that did start ourselves
+    if (nullptr != failure) {
+        stop();
+        std::rethrow_exception(failure);
+    }
+}
+
+LuaContextPool::~LuaContextPool() {
+    stop();
+}
+
+int LuaContextPool::size() const {
+    return SA::size(_shards);
+}
+
+std::shared_ptr< LuaContext > LuaContextPool::shard(int idx) const {
+    return _shards[idx].lock();
+}
+
+StrongMsgPtr LuaContextPool::makeRouter(const char* name,int keySlot) const {
+    std::vector< StrongMsgPtr > targets;
+    TEMPLATIOUS_FOREACH(auto& i,_shards) {
+        auto ctx = i.lock();
+        assert( nullptr != ctx && "Pool already stopped." );
+        auto target = ctx->getMessageable(name);
+        assert( nullptr != target && "Shard doesn't expose messageable." );
+        SA::add(targets,target);
+    }
+    return std::make_shared< ShardRouter >(_fact,targets,keySlot);
+}
+
+void LuaContextPool::stop() {
+    TEMPLATIOUS_FOREACH(auto& i,_shards) {
+        auto ctx = i.lock();
+        if (nullptr != ctx) {
+            ctx->stop();
+        }
+    }
+
+    TEMPLATIOUS_FOREACH(auto& i,_threads) {
+        if (i.joinable()) {
+            i.join();
+        }
+    }
+}
+
+// Is update dependency of its context, every
+// OutRequestUpdate (sent from whatever thread
+// enqueued) schedules it.
+struct ActorScheduler::Actor : public Messageable {
+    enum State {
+        Idle, Scheduled, Running, RunAgain, Retired
+    };
+
+    Actor(ActorScheduler* sched) :
+        _sched(sched), _state(Idle), _retired(false),
+        _mailbox(nullptr),
+        _timerAt(std::chrono::steady_clock::time_point::max()) {}
+
+    void message(templatious::VirtualPack& msg) override {
+        _sched->schedule(this);
+    }
+
+    void message(const StrongPackPtr& msg) override {
+        _sched->schedule(this);
+    }
+
+    ActorScheduler* _sched;
+    std::shared_ptr< LuaContext > _ctx;
+    std::atomic< int > _state;
+    std::atomic< bool > _retired;
+    std::weak_ptr< Actor > _self;
+    // identity only
+    Messageable* _mailbox;
+    // queued timer deadline, guarded by _timerMtx
+    std::chrono::steady_clock::time_point _timerAt;
+};
+
+struct ActorScheduler::Worker {
+    WorkStealingDeque< Actor* > _deque;
+};
+
+namespace {
+    // worker running on this thread, if any
+    thread_local ActorScheduler* t_scheduler = nullptr;
+    thread_local int t_worker = -1;
+    thread_local unsigned t_seed = 0;
+}
+
+ActorScheduler::ActorScheduler(int workers,
+    templatious::DynVPackFactory* fact,
+    const char* luaPlumbingFile) :
+    _fact(fact), _plumbingFile(luaPlumbingFile),
+    _runBudget(64), _stop(false),
+    _injectSize(0),
+    _nextTimer(std::chrono::steady_clock::time_point::max()
+        .time_since_epoch().count()),
+    _idle(0)
+{
+    assert( workers > 0 && "Scheduler needs workers." );
+
+    TEMPLATIOUS_0_TO_N(i,workers) {
+        SA::add(_workers,std::unique_ptr< Worker >(new Worker()));
+    }
+
+    TEMPLATIOUS_0_TO_N(i,workers) {
+        _threads.emplace_back([=]() { workerLoop(i); });
+    }
+}
+
+ActorScheduler::~ActorScheduler() {
+    stop();
+}
+
+StrongMsgPtr ActorScheduler::spawn(const Setup& setup) {
+    auto actor = std::make_shared< Actor >(this);
+    actor->_self = actor;
+    auto ctx = LuaContext::makeContext(_plumbingFile.c_str());
+    ctx->setFactory(_fact);
+    actor->_ctx = ctx;
+    setup(*ctx);
+
+    auto mailbox = ctx->getMessageable("mailbox");
+    assert( nullptr != mailbox && "Actor setup must expose mailbox." );
+    actor->_mailbox = mailbox.get();
+
+    {
+        std::lock_guard< std::mutex > g(_actorMtx);
+        SA::add(_actors,actor);
+    }
+
+    // only now, setup can't run concurrently
+    // with the actor. First run picks up
+    // anything setup sent.
+    LuaContextImpl::setDependency(*ctx,actor);
+    schedule(actor.get());
+    return mailbox;
+}
+
+bool ActorScheduler::retire(const StrongMsgPtr& mailbox) {
+    // held, runner may release it meanwhile
+    std::shared_ptr< Actor > actor;
+    {
+        std::lock_guard< std::mutex > g(_actorMtx);
+        TEMPLATIOUS_FOREACH(auto& i,_actors) {
+            if (i->_mailbox == mailbox.get()) {
+                actor = i;
+                break;
+            }
+        }
+        if (nullptr == actor || actor->_retired.exchange(true)) {
+            return false;
+        }
+    }
+
+    // queued or running actor is released
+    // by its runner instead
+    int state = Actor::Idle;
+    if (actor->_state.compare_exchange_strong(state,Actor::Retired)) {
+        release(actor.get());
+    }
+    return true;
+}
+
+void ActorScheduler::release(Actor* actor) {
+    std::shared_ptr< Actor > dead;
+    {
+        std::lock_guard< std::mutex > g(_actorMtx);
+        auto found = std::find_if(_actors.begin(),_actors.end(),
+            [=](const std::shared_ptr< Actor >& i) {
+                return i.get() == actor;
+            });
+        if (found == _actors.end()) {
+            return;
+        }
+        dead = std::move(*found);
+        _actors.erase(found);
+    }
+    // context goes away outside of the lock
+}
+
+void ActorScheduler::setRunBudget(int messages) {
+    _runBudget.store(messages);
+}
+
+int ActorScheduler::actorCount() const {
+    std::lock_guard< std::mutex > g(_actorMtx);
+    return SA::size(_actors);
+}
+
+int ActorScheduler::workerCount() const {
+    return SA::size(_workers);
+}
+
+void ActorScheduler::stop() {
+    _stop.store(true);
+    {
+        std::lock_guard< std::mutex > g(_parkMtx);
+        _parkCond.notify_all();
+    }
+
+    TEMPLATIOUS_FOREACH(auto& i,_threads) {
+        if (i.joinable()) {
+            i.join();
+        }
+    }
+
+    std::lock_guard< std::mutex > g(_actorMtx);
+    SA::clear(_actors);
+}
+
+void ActorScheduler::schedule(Actor* actor) {
+    int state = actor->_state.load();
+    for (;;) {
+        switch (state) {
+            case Actor::Idle:
+                if (actor->_state.compare_exchange_weak(
+                    state,Actor::Scheduled))
+                {
+                    enqueue(actor);
+                    return;
+                }
+                break;
+            case Actor::Running:
+                // runner reschedules once done
+                if (actor->_state.compare_exchange_weak(
+                    state,Actor::RunAgain))
+                {
+                    return;
+                }
+                break;
+            default:
+                return;
+        }
+    }
+}
+
+void ActorScheduler::enqueue(Actor* actor) {
+    if (this == t_scheduler) {
+        _workers[t_worker]->_deque.push(actor);
+    } else {
+        std::lock_guard< std::mutex > g(_injectMtx);
+        _inject.push_back(actor);
+        _injectSize.fetch_add(1);
+    }
+
+    // pairs with fence in park
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_idle.load() > 0) {
+        std::lock_guard< std::mutex > g(_parkMtx);
+        _parkCond.notify_one();
+    }
+}
+
+void ActorScheduler::workerLoop(int idx) {
+    t_scheduler = this;
+    t_worker = idx;
+    t_seed = static_cast<unsigned>(idx) * 2654435761u + 1;
+
+    Actor* actor = nullptr;
+    while (!_stop.load()) {
+        fireTimers();
+        if (findWork(idx,actor)) {
+            runActor(actor);
+        } else {
+            park();
+        }
+    }
+
+    t_scheduler = nullptr;
+    t_worker = -1;
+}
+
+bool ActorScheduler::findWork(int idx,Actor*& out) {
+    if (_workers[idx]->_deque.pop(out)) {
+        return true;
+    }
+
+    if (_injectSize.load() > 0) {
+        std::lock_guard< std::mutex > g(_injectMtx);
+        if (!_inject.empty()) {
+            out = _inject.front();
+            _inject.pop_front();
+            _injectSize.fetch_sub(1);
+            return true;
+        }
+    }
+
+    // random victim first, then the rest
+    int count = SA::size(_workers);
+    t_seed ^= t_seed << 13;
+    t_seed ^= t_seed >> 17;
+    t_seed ^= t_seed << 5;
+    int start = static_cast<int>(t_seed % count);
+    TEMPLATIOUS_0_TO_N(i,count) {
+        int victim = (start + i) % count;
+        if (victim != idx && _workers[victim]->_deque.steal(out)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ActorScheduler::runActor(Actor* actor) {
+    if (actor->_retired.load()) {
+        actor->_state.store(Actor::Retired);
+        release(actor);
+        return;
+    }
+
+    actor->_state.store(Actor::Running);
+
+    int left = actor->_ctx->processMessages(
+        _runBudget.load(),std::chrono::steady_clock::duration::zero());
+
+    // while still running, once idle the
+    // actor may be run or released elsewhere
+    armTimer(actor);
+
+    // once idle retire may release it
+    // before check below is done
+    auto held = actor->_self.lock();
+    int state = Actor::Running;
+    if (0 == left && actor->_state.compare_exchange_strong(state,Actor::Idle)) {
+        // either this or retire wins the actor
+        state = Actor::Idle;
+        if (actor->_retired.load()
+            && actor->_state.compare_exchange_strong(state,Actor::Retired))
+        {
+            release(actor);
+        }
+        return;
+    }
+
+    // notified while running or out of budget
+    actor->_state.store(Actor::Scheduled);
+    enqueue(actor);
+}
+
+// Runner only, nobody else touches the wheel.
+void ActorScheduler::armTimer(Actor* actor) {
+    typedef std::chrono::steady_clock Clock;
+    auto until = LuaContextImpl::untilNextTimer(*actor->_ctx);
+    if (until == Clock::duration::max()) {
+        return;
+    }
+
+    auto at = Clock::now() + until;
+    std::lock_guard< std::mutex > g(_timerMtx);
+    // earlier deadline already queued covers
+    // this one, the run it triggers arms next
+    if (actor->_timerAt <= at) {
+        return;
+    }
+    actor->_timerAt = at;
+    _timerQueue.emplace(at,actor->_self);
+    _nextTimer.store(_timerQueue.begin()->first.time_since_epoch().count());
+}
+
+void ActorScheduler::fireTimers() {
+    typedef std::chrono::steady_clock Clock;
+    auto now = Clock::now();
+    if (now.time_since_epoch().count() < _nextTimer.load()) {
+        return;
+    }
+
+    std::vector< std::shared_ptr< Actor > > due;
+    {
+        std::lock_guard< std::mutex > g(_timerMtx);
+        while (!_timerQueue.empty() && _timerQueue.begin()->first <= now) {
+            auto first = _timerQueue.begin();
+            auto actor = first->second.lock();
+            // superseded entries are skipped
+            if (nullptr != actor && actor->_timerAt == first->first) {
+                actor->_timerAt = Clock::time_point::max();
+                SA::add(due,std::move(actor));
+            }
+            _timerQueue.erase(first);
+        }
+        _nextTimer.store(_timerQueue.empty() ?
+            Clock::time_point::max().time_since_epoch().count() :
+            _timerQueue.begin()->first.time_since_epoch().count());
+    }
+
+    // retired actors refuse scheduling
+    TEMPLATIOUS_FOREACH(auto& i,due) {
+        schedule(i.get());
+    }
+}
+
+void ActorScheduler::park() {
+    typedef std::chrono::steady_clock Clock;
+    std::unique_lock< std::mutex > l(_parkMtx);
+    _idle.fetch_add(1);
+    // pairs with fence in enqueue
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!hasWork() && !_stop.load()) {
+        // timeout is a backstop only,
+        // unless a timer is due sooner
+        auto wakeAt = Clock::now() + std::chrono::milliseconds(10);
+        auto timer = Clock::time_point(Clock::duration(_nextTimer.load()));
+        if (timer < wakeAt) {
+            wakeAt = timer;
+        }
+        _parkCond.wait_until(l,wakeAt);
+    }
+    _idle.fetch_sub(1);
+}
+
+bool ActorScheduler::hasWork() const {
+    if (_injectSize.load() > 0) {
+        return true;
+    }
+    TEMPLATIOUS_FOREACH(auto& i,_workers) {
+        if (i->_deque.size() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -2,9 +2,14 @@
 #define DOMAIN_8UU5DBQ1
 
 #include <vector>
+#include <deque>
 #include <map>
+#include <unordered_map>
+#include <string>
 #include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <thread>
 #include <cassert>
 
@@ -14,11 +19,15 @@
 #include PLUMBING_LUA_INCLUDE
 
 #include "messageable.hpp"
+#include "timerwheel.hpp"
 
 typedef int (*lua_CFunction) (lua_State *L);
 
 typedef std::weak_ptr< struct LuaContext > WeakCtxPtr;
 
+template <class... T> struct LuaFuture;
+struct ContextMessageable;
+
 struct ThreadGuard {
     ThreadGuard() :
         _id(std::this_thread::get_id())
@@ -53,50 +62,199 @@ struct GenericMessageableInterface {
     struct OutRequestUpdate {};
 };
 
-// WARNING, this class is single threaded.
+// WARNING, this class is single threaded
+// (except for ReadyToken::markReady).
 struct CallbackCache {
 
+    struct ReadyToken;
+    typedef std::shared_ptr< ReadyToken > TokenPtr;
+
+    // Scheduled driver only runs on passes after
+    // it was marked ready, idle ones cost nothing.
+    struct ReadyToken : public std::enable_shared_from_this< ReadyToken > {
+        // may be called from any thread
+        void markReady();
+
+    private:
+        friend struct CallbackCache;
+        typedef MpscQueue< TokenPtr > ReadyQueue;
+
+        ReadyToken(const std::function<bool()>& func,
+            const std::weak_ptr< ReadyQueue >& queue);
+
+        std::function<bool()> _func;
+        std::atomic< bool > _ready;
+        // processing thread only, set while
+        // _func runs (nested passes skip it)
+        bool _busy;
+        std::weak_ptr< ReadyQueue > _queue;
+    };
+
+    // Removal handle of an attached driver,
+    // stays invalid once driver is gone.
+    struct Handle {
+        Handle() : _index(-1), _gen(0) {}
+
+        bool valid() const {
+            return _index >= 0;
+        }
+
+    private:
+        friend struct CallbackCache;
+        Handle(int index,unsigned gen) : _index(index), _gen(gen) {}
+
+        int _index;
+        unsigned _gen;
+    };
+
+    CallbackCache();
+
     void process();
-    void attach(const std::function<bool()>& func);
+
+    // Runs drivers until budget is exhausted,
+    // drivers not reached go first next time.
+    void process(ProcessBudget& budget);
+
+    // runs on every pass until it returns false
+    // or is detached, safe to call from drivers
+    Handle attach(const std::function<bool()>& func);
+
+    // returns false if driver is already gone
+    bool detach(const Handle& handle);
+
+    // attached drivers, not counting scheduled
+    int driverCount() const;
+
+    // runs only when marked ready through token
+    TokenPtr attachScheduled(const std::function<bool()>& func);
 
 private:
-    std::vector< std::pair<
-        bool, std::function<bool()>
-    > > _eventDriver;
+    void processDrivers(ProcessBudget& budget);
+    void processScheduled(ProcessBudget& budget);
+
+    void release(int index);
+
+    struct Slot {
+        Slot() : _gen(0), _pass(0), _nextFree(-1),
+            _live(false), _busy(false), _detached(false) {}
+
+        std::function<bool()> _func;
+        // bumped on release, stales old handles
+        unsigned _gen;
+        // pass it last ran in or was attached
+        // during, nested passes have higher ones
+        unsigned long long _pass;
+        int _nextFree;
+        bool _live;
+        // running now, nested passes skip it
+        bool _busy;
+        // detached while running, released
+        // once it returns
+        bool _detached;
+    };
+
+    // live, idle and neither ran nor
+    // attached since pass started
+    static bool isDue(const Slot& slot,unsigned long long pass);
+
+    // deque keeps the running slot in place
+    // if drivers attach while being processed
+    std::deque< Slot > _slots;
+    int _freeHead;
+    int _liveCount;
+    // rotation point for budgeted passes
+    int _cursor;
+    // last started pass, nested passes included
+    unsigned long long _pass;
+
+    std::shared_ptr< ReadyToken::ReadyQueue > _ready;
+    // ready, but budget ran out last pass
+    std::vector< TokenPtr > _readyCarry;
+    // spare storage, swapped into the local
+    // buffer of a pass and back
+    std::vector< TokenPtr > _readyRun;
+};
+
+// Lua functions held for async callbacks, kept
+// in own table with a free list instead of the
+// registry. Same function shares one slot while
+// referenced, released slots are cleared in
+// batches by flush.
+// WARNING, this class is single threaded.
+struct CallbackSlots {
+    CallbackSlots();
+
+    // creates backing tables
+    void init(lua_State* s);
+
+    // references function at idx, returns slot
+    int ref(lua_State* s,int idx);
+
+    // pushes function in slot
+    void push(lua_State* s,int slot);
+
+    // cleared on next flush unless ref'd again
+    void release(int slot);
+
+    void flush(lua_State* s);
+
+    // slots holding a function
+    int used() const;
+
+private:
+    // registry refs of slot -> function
+    // and function -> slot tables
+    int _table;
+    int _index;
+    // indexed by slot, 0 is unused
+    std::vector< int > _counts;
+    std::vector< int > _free;
+    std::vector< int > _released;
 };
 
 struct AsyncCallbackMessage {
 
+    // empty, owns no callback
+    AsyncCallbackMessage() :
+        _funcRef(-1),
+        _shouldCall(false) {}
+
     AsyncCallbackMessage(const AsyncCallbackMessage&) = delete;
 
     AsyncCallbackMessage(AsyncCallbackMessage&& other) :
-        _tableRef(other._tableRef),
         _funcRef(other._funcRef),
         _shouldCall(other._shouldCall),
-        _pack(other._pack),
+        _pack(std::move(other._pack)),
         _ctx(other._ctx)
     {
-        other._tableRef = -1;
         other._funcRef = -1;
     }
 
+    // swaps, previous callback is released
+    // by the other one
+    AsyncCallbackMessage& operator=(AsyncCallbackMessage&& other) {
+        std::swap(_funcRef,other._funcRef);
+        std::swap(_shouldCall,other._shouldCall);
+        std::swap(_pack,other._pack);
+        std::swap(_ctx,other._ctx);
+        return *this;
+    }
+
+    // funcRef is slot in context's CallbackSlots,
+    // shouldCall is final (deadline was already
+    // checked when result came back)
     AsyncCallbackMessage(
-        int tableRef,int funcRef,
+        int funcRef,
         bool shouldCall,
         const StrongPackPtr& ptr,
         const WeakCtxPtr& ctx
     ) :
-        _tableRef(tableRef),
         _funcRef(funcRef),
         _shouldCall(shouldCall),
         _pack(ptr), _ctx(ctx) {}
 
     ~AsyncCallbackMessage();
 
-    int tableRef() {
-        return _tableRef;
-    }
-
     int funcRef() {
         return _funcRef;
     }
@@ -110,13 +268,70 @@ struct AsyncCallbackMessage {
     }
 
 private:
-    int _tableRef;
     int _funcRef;
     bool _shouldCall;
     StrongPackPtr _pack;
     WeakCtxPtr _ctx;
 };
 
+// Recycles packs of plain async sends, keyed by
+// signature (primitive slots are refilled, other
+// slots must match exactly). Pack is reused once
+// the pool holds the only reference to it.
+// Lua handlers hold their pack until the message
+// userdata is collected, so with lua receivers
+// reuse waits for GC. Reuse only sees strong
+// references: receiver must not keep a weak_ptr
+// to a pack, it could lock it while it's being
+// refilled. Set limit to zero if any does.
+// WARNING, this class is single threaded.
+struct PackPool {
+
+    struct Stats {
+        Stats() : size(0), hits(0), misses(0) {}
+
+        double hitRate() const {
+            long total = hits + misses;
+            return total > 0 ? double(hits) / total : 0;
+        }
+
+        // packs held by the pool
+        int size;
+        long hits;
+        long misses;
+    };
+
+    PackPool() : _perSignature(16), _size(0) {}
+
+    PackPool(const PackPool&) = delete;
+    PackPool(PackPool&&) = delete;
+
+    /**
+     * Packs kept per signature, zero disables
+     * pooling and frees pooled packs.
+     */
+    void setLimit(int perSignature);
+
+    Stats stats() const;
+
+    // makes pack through factory on a miss
+    StrongPackPtr make(
+        const templatious::DynVPackFactory& fact,
+        int size,const char** types,const char** values);
+
+private:
+    typedef std::vector< StrongPackPtr > Bucket;
+
+    bool makeKey(int size,const char** types,const char** values);
+
+    int _perSignature;
+    int _size;
+    Stats _stats;
+    // reused so lookups don't allocate
+    std::string _key;
+    std::unordered_map< std::string, Bucket > _buckets;
+};
+
 struct LuaContext {
     lua_State* s() const { assertThread(); return _s; }
 
@@ -153,11 +368,91 @@ struct LuaContext {
      */
     void processMessages();
 
+    /**
+     * Process messages until maxMessages are handled
+     * or maxDuration elapses (zero means no limit).
+     * Work left over is kept for the next call.
+     * Returns known amount of work left.
+     */
+    int processMessages(int maxMessages,
+        std::chrono::steady_clock::duration maxDuration);
+
+    /**
+     * Async send pack pool stats and limit,
+     * see PackPool.
+     */
+    PackPool::Stats packPoolStats() const;
+    void setPackPoolLimit(int perSignature);
+
+    /**
+     * File descriptor (eventfd) that becomes readable
+     * when processMessages has work, for epoll/select
+     * loops. Created on first call, owned by context.
+     * Returns -1 where eventfd isn't supported.
+     */
+    int wakeupFd();
+
+    /**
+     * Drive processing on calling thread until stop
+     * is called. After each pass spins for spin
+     * duration, then parks until something is enqueued.
+     * Drivers attached through InAttachToEventLoop by
+     * other messageables only run when context wakes.
+     */
+    void run();
+
+    /**
+     * Same as run, but returns once timeout elapses.
+     * Returns true if stopped by stop.
+     */
+    bool runFor(std::chrono::steady_clock::duration timeout);
+
+    // may be called from any thread
+    void stop();
+
+    /**
+     * How long run spins before parking, longer
+     * means lower latency but more CPU usage.
+     */
+    void setSpinDuration(std::chrono::steady_clock::duration spin);
+
+    /**
+     * Fire callback from processMessages after delay
+     * (and then every period if not zero).
+     * Call from processing thread only.
+     */
+    TimerWheel::TimerId schedule(
+        std::chrono::steady_clock::duration delay,
+        std::chrono::steady_clock::duration period,
+        const std::function<void()>& func);
+
+    // returns false if timer already finished
+    bool cancelTimer(TimerWheel::TimerId id);
+
+    /**
+     * Send values as async pack of types T to target
+     * (ie. LuaMessageHandler). Future gets the values
+     * once handler ran on its context thread and filled
+     * the slots, fails if pack was rejected or dropped.
+     * If handler forwarded the pack, future settles
+     * once the last holder is done with it.
+     * May be called from any thread.
+     * Defined in luafuture.hpp.
+     */
+    template <class... T,class... Args>
+    LuaFuture< T... > request(const StrongMsgPtr& target,Args&&... args);
+
+    // same as above, target looked up by name
+    template <class... T,class... Args>
+    LuaFuture< T... > request(const char* name,Args&&... args);
+
 private:
     LuaContext();
 
     friend struct AsyncCallbackStruct;
+    friend struct AsyncCallbackMessage;
     friend struct LuaContextImpl;
+    friend struct LuaMessageHandler;
 
     typedef std::lock_guard< std::mutex > Guard;
 
@@ -170,12 +465,203 @@ private:
     ThreadGuard _tg;
 
     CallbackCache _eventDriver;
-    std::vector< AsyncCallbackMessage > _callbacks;
+    CallbackSlots _callbackSlots;
+    // completed async callbacks, pushed from any
+    // thread without taking _mtx
+    MpscQueue< AsyncCallbackMessage > _callbacks;
+    // processing thread only, left by budgeted pass
+    std::deque< AsyncCallbackMessage > _callbackBacklog;
+    // reused storage for callbacks dispatched in a pass
+    std::vector< AsyncCallbackMessage > _callbackBatch;
+    // batch walked by lua dispatcher, null if none
+    std::vector< AsyncCallbackMessage >* _dispatchBatch;
+    int _dispatchPos;
+    // budget of pass in progress, null if none
+    ProcessBudget* _budget;
+    PackPool _packPool;
     std::weak_ptr< LuaContext > _myselfWeak;
+    // "context" messageable, its queued control
+    // messages are handled in every pass
+    std::weak_ptr< ContextMessageable > _contextMsg;
     WeakMsgPtr _updateDependency;
+    // set once dependency was notified,
+    // cleared when processing starts
+    std::atomic< bool > _updatePending;
+    // -1 until wakeupFd is asked for
+    std::atomic< int > _wakeFd;
+
+    std::atomic< bool > _stopRequested;
+    std::atomic< int > _parked;
+    std::chrono::steady_clock::duration _spinDuration;
+    std::mutex _parkMtx;
+    std::condition_variable _parkCond;
+
+    TimerWheel _timers;
 
     std::string _lastError;
 };
 
+// Spreads async messages over messageables of
+// context pool shards by hash of one pack slot,
+// packs with equal key keep their order.
+// Sync messages go straight to target shard's
+// messageable on caller thread, unserialized with
+// its loop. Lua handlers only allow that from
+// their own shard thread.
+struct ShardRouter : public Messageable {
+    // keySlot counts from 1
+    ShardRouter(const templatious::DynVPackFactory* fact,
+        const std::vector< StrongMsgPtr >& targets,int keySlot);
+
+    void message(const StrongPackPtr& msg) override;
+    void message(templatious::VirtualPack& msg) override;
+    bool tryMessage(const StrongPackPtr& msg) override;
+    bool tryMessage(const StrongPackPtr& msg,
+        const SendOptions& options) override;
+
+    // shard pack is routed to, packs without
+    // key slot go to first shard
+    int shardFor(const templatious::VirtualPack& pack) const;
+
+private:
+    const templatious::DynVPackFactory* _fact;
+    std::vector< StrongMsgPtr > _targets;
+    int _keySlot;
+};
+
+// N contexts running on N threads, each started
+// from the same scripts.
+struct LuaContextPool {
+    // runs on shard thread once scripts are loaded,
+    // gets shard index
+    typedef std::function< void(LuaContext&,int) > Setup;
+
+    // Blocks until every shard is running. If setup
+    // throws on any shard, pool is stopped and the
+    // first exception is rethrown here.
+    LuaContextPool(int shards,
+        templatious::DynVPackFactory* fact,
+        const std::vector< std::string >& scripts,
+        const Setup& setup = nullptr,
+        const char* luaPlumbingFile = "plumbing.lua");
+
+    LuaContextPool(const LuaContextPool&) = delete;
+    LuaContextPool(LuaContextPool&&) = delete;
+
+    ~LuaContextPool();
+
+    int size() const;
+
+    /**
+     * Context of shard, null once stopped. It runs
+     * on its own thread, only talk to it through
+     * messageables.
+     */
+    std::shared_ptr< LuaContext > shard(int idx) const;
+
+    /**
+     * Router to messageable named name in every
+     * shard (see exposeMessageable in lua), hashing
+     * keySlot of incoming packs.
+     */
+    StrongMsgPtr makeRouter(const char* name,int keySlot) const;
+
+    // stops shard loops and joins threads
+    void stop();
+
+private:
+    templatious::DynVPackFactory* _fact;
+    std::vector< std::weak_ptr< LuaContext > > _shards;
+    std::vector< std::thread > _threads;
+};
+
+// M:N runtime for many small lua contexts (actors).
+// Actors are scheduled on a fixed set of worker
+// threads with work stealing deques once their
+// mailbox has work or a timer is due, an actor
+// is only ever run by one thread at a time.
+struct ActorScheduler {
+    typedef std::function< void(LuaContext&) > Setup;
+
+    ActorScheduler(int workers,
+        templatious::DynVPackFactory* fact,
+        const char* luaPlumbingFile = "plumbing.lua");
+
+    ActorScheduler(const ActorScheduler&) = delete;
+    ActorScheduler(ActorScheduler&&) = delete;
+
+    // stops workers, then destroys actors
+    ~ActorScheduler();
+
+    /**
+     * Creates actor context and runs setup on it
+     * (calling thread). Setup must expose handler
+     * attached to processing as "mailbox" (see
+     * exposeMessageable in lua), which is returned.
+     */
+    StrongMsgPtr spawn(const Setup& setup);
+
+    /**
+     * Removes actor owning mailbox returned by
+     * spawn. Its context is destroyed once no worker
+     * is running it, mailbox rejects messages from
+     * then on. False if mailbox is not of this
+     * scheduler or already retired.
+     */
+    bool retire(const StrongMsgPtr& mailbox);
+
+    /**
+     * Messages an actor may handle per run before
+     * yielding to others, zero for no limit.
+     */
+    void setRunBudget(int messages);
+
+    int actorCount() const;
+    int workerCount() const;
+
+    void stop();
+
+private:
+    struct Actor;
+    struct Worker;
+
+    void schedule(Actor* actor);
+    void enqueue(Actor* actor);
+    void workerLoop(int idx);
+    bool findWork(int idx,Actor*& out);
+    void runActor(Actor* actor);
+    void release(Actor* actor);
+    void armTimer(Actor* actor);
+    void fireTimers();
+    void park();
+    bool hasWork() const;
+
+    templatious::DynVPackFactory* _fact;
+    std::string _plumbingFile;
+    std::atomic< int > _runBudget;
+    std::atomic< bool > _stop;
+
+    std::vector< std::unique_ptr< Worker > > _workers;
+    std::vector< std::thread > _threads;
+
+    mutable std::mutex _actorMtx;
+    std::vector< std::shared_ptr< Actor > > _actors;
+
+    // scheduled from outside of worker threads
+    std::mutex _injectMtx;
+    std::deque< Actor* > _inject;
+    std::atomic< int > _injectSize;
+
+    // idle actors with pending timers, by deadline
+    std::mutex _timerMtx;
+    std::multimap< std::chrono::steady_clock::time_point,
+        std::weak_ptr< Actor > > _timerQueue;
+    std::atomic< std::chrono::steady_clock::rep > _nextTimer;
+
+    std::mutex _parkMtx;
+    std::condition_variable _parkCond;
+    std::atomic< int > _idle;
+};
+
 #endif /* end of include guard: DOMAIN_8UU5DBQ1 */
 
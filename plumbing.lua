@@ -14,6 +14,32 @@ function messageablesEqual(a,b)
     return nat_areMessageablesEqual(a,b)
 end
 
+-- called once per processMessages pass to run
+-- completed async callbacks, errors unwind
+-- to native side which calls this again.
+-- Callback may be coroutine suspended in await.
+function __dispatchAsyncCallbacks()
+    local ctx = __luaContext
+    local nextCallback = nat_nextAsyncCallback
+    local resume = coroutine.resume
+    while true do
+        local func, tree = nextCallback(ctx)
+        if (nil == func) then
+            return
+        end
+        if (type(func) == "thread") then
+            local ok, err = resume(func, tree)
+            if (not ok) then
+                error(err, 0)
+            end
+        elseif (nil ~= tree) then
+            func(tree)
+        else
+            func()
+        end
+    end
+end
+
 initLuaContext = function(context)
     local meta = getmetatable(context)
     meta.__index.message =
@@ -22,6 +48,22 @@ initLuaContext = function(context)
             return nat_sendPack(self,messageable,vtree)
         end
 
+    -- prebound stubs, resolved once per signature name:
+    -- luaContext().msgs.msg_a(messageable,VInt(1))
+    local stubs = {}
+    setmetatable(stubs,{
+        __index = function(tbl,name)
+            local sig = nat_makePrebound(name)
+            local stub = function(messageable,...)
+                local vtree = toValueTree(...)
+                return nat_sendPackPrebound(context,messageable,sig,vtree)
+            end
+            rawset(tbl,name,stub)
+            return stub
+        end
+    })
+    meta.__index.msgs = stubs
+
     meta.__index.messageWCallback =
         function(self,messageable,callback,...)
             local vtree = toValueTree(...)
@@ -41,25 +83,106 @@ initLuaContext = function(context)
     meta.__index.messageAsync =
         function(self,messageable,...)
             local vtree = toValueTree(...)
-            nat_sendPackAsync(self,messageable,nil,vtree)
+            return nat_sendPackAsync(self,messageable,nil,0,0,vtree)
         end
 
     meta.__index.messageAsyncWError =
         function(self,messageable,errorcallback,...)
             local vtree = toValueTree(...)
-            nat_sendPackAsync(self,messageable,errorcallback,vtree)
+            return nat_sendPackAsync(self,messageable,errorcallback,0,0,vtree)
+        end
+
+    meta.__index.messageAsyncPriority =
+        function(self,messageable,priority,...)
+            local vtree = toValueTree(...)
+            return nat_sendPackAsync(self,messageable,nil,priority,0,vtree)
+        end
+
+    -- dropped if not handled within timeout
+    -- milliseconds, error callback fires then
+    meta.__index.messageAsyncTimeout =
+        function(self,messageable,timeout,errorcallback,...)
+            local vtree = toValueTree(...)
+            return nat_sendPackAsync(self,messageable,errorcallback,0,timeout,vtree)
         end
 
     meta.__index.messageAsyncWCallback =
         function(self,messageable,callback,...)
             local vtree = toValueTree(...)
-            nat_sendPackAsyncWCallback(self,messageable,callback,nil,vtree)
+            return nat_sendPackAsyncWCallback(self,messageable,callback,nil,0,vtree)
         end
 
     meta.__index.messageAsyncWCallbackWError =
         function(self,messageable,callback,errorcallback,...)
             local vtree = toValueTree(...)
-            nat_sendPackAsyncWCallback(self,messageable,callback,errorcallback,vtree)
+            return nat_sendPackAsyncWCallback(self,messageable,callback,errorcallback,0,vtree)
+        end
+
+    meta.__index.messageAsyncWCallbackTimeout =
+        function(self,messageable,timeout,callback,errorcallback,...)
+            local vtree = toValueTree(...)
+            return nat_sendPackAsyncWCallback(self,messageable,callback,errorcallback,timeout,vtree)
+        end
+
+    -- sends async and suspends calling coroutine until
+    -- reply, returns reply values or nil if message
+    -- was rejected, dropped or timed out. Coroutine
+    -- itself is the callback, no closure per call.
+    meta.__index.await =
+        function(self,messageable,...)
+            return self:awaitTimeout(messageable,0,...)
+        end
+
+    meta.__index.awaitTimeout =
+        function(self,messageable,timeout,...)
+            local co, isMain = coroutine.running()
+            assert( nil ~= co and not isMain,
+                "await must be called inside coroutine." )
+            local vtree = toValueTree(...)
+            nat_sendPackAsyncWCallback(self,messageable,co,co,timeout,vtree)
+            local out = coroutine.yield()
+            if (nil == out) then
+                return nil
+            end
+            return out:values()
+        end
+
+    -- runs func as coroutine so it may await,
+    -- returns once func finishes or first awaits
+    meta.__index.runAsync =
+        function(self,func,...)
+            local co = coroutine.create(func)
+            local ok, err = coroutine.resume(co,...)
+            if (not ok) then
+                error(err, 0)
+            end
+            return co
+        end
+
+    -- latest pack per signature (and key slot) wins
+    -- while waiting in handler's queue
+    meta.__index.setCoalescing =
+        function(self,handler,enabled,keySlot)
+            return nat_setCoalescing(self,handler,enabled,keySlot or 0)
+        end
+
+    -- target is function or messageable which is
+    -- sent the message, returns handle for cancelTimer
+    meta.__index.after =
+        function(self,millis,target,...)
+            local vtree = toValueTree(...)
+            return nat_scheduleTimer(self,millis,0,target,vtree)
+        end
+
+    meta.__index.every =
+        function(self,millis,target,...)
+            local vtree = toValueTree(...)
+            return nat_scheduleTimer(self,millis,millis,target,vtree)
+        end
+
+    meta.__index.cancelTimer =
+        function(self,handle)
+            return nat_cancelTimer(self,handle)
         end
 
     meta.__index.attachToProcessing =
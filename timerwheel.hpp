@@ -0,0 +1,287 @@
+#ifndef TIMERWHEEL_H8N3V6QX
+#define TIMERWHEEL_H8N3V6QX
+
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <cassert>
+#include <cstdint>
+
+// Hierarchical timer wheel (4 levels of 64 slots).
+// Schedule and cancel are O(1), advance is
+// O(ticks passed + timers fired).
+//
+// WARNING, this class is single threaded.
+struct TimerWheel {
+    typedef std::chrono::steady_clock Clock;
+    typedef std::function<void()> Callback;
+    typedef long long TimerId;
+
+    explicit TimerWheel(
+        Clock::duration tick = std::chrono::milliseconds(1)) :
+        _tick(tick), _start(Clock::now()), _now(0),
+        _lastId(0), _firing(nullptr), _firingCancelled(false),
+        _advancing(false)
+    {
+        assert( tick > Clock::duration::zero() && "Zero tick." );
+        for (auto& level: _slots) {
+            for (auto& slot: level) {
+                slot.makeSentinel();
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel(TimerWheel&&) = delete;
+
+    ~TimerWheel() {
+        for (auto& i: _timers) {
+            delete i.second;
+        }
+    }
+
+    /**
+     * Fire callback after delay, then every period
+     * if period is not zero. Returns id for cancel.
+     */
+    TimerId schedule(Clock::duration delay,
+        Clock::duration period,const Callback& cb)
+    {
+        Node* n = new Node();
+        n->_id = ++_lastId;
+        n->_period = toTicks(period);
+        n->_cb = cb;
+        // wheel only moves in advance, after idle time
+        // _now is stale, so count from the clock
+        uint64_t from = tickAt(Clock::now());
+        if (from < _now) {
+            from = _now;
+        }
+        n->_expiry = from + toTicks(delay);
+        // fire on next advance at the earliest
+        if (n->_expiry <= _now) {
+            n->_expiry = _now + 1;
+        }
+        _timers.insert(std::make_pair(n->_id,n));
+        insert(n);
+        return n->_id;
+    }
+
+    // returns false if timer doesn't exist (anymore)
+    bool cancel(TimerId id) {
+        auto iter = _timers.find(id);
+        if (iter == _timers.end()) {
+            return false;
+        }
+
+        Node* n = iter->second;
+        _timers.erase(iter);
+        if (n == _firing) {
+            // deleted once its callback returns
+            _firingCancelled = true;
+            return true;
+        }
+
+        n->unlink();
+        delete n;
+        return true;
+    }
+
+    // Fires timers due up to now, returns fired
+    // count. Nested calls from callbacks are no-ops.
+    int advance(Clock::time_point now) {
+        if (_advancing) {
+            return 0;
+        }
+
+        uint64_t target = tickAt(now);
+        if (_timers.empty()) {
+            if (target > _now) {
+                _now = target;
+            }
+            return 0;
+        }
+        _advancing = true;
+
+        int fired = 0;
+        while (_now < target) {
+            ++_now;
+            cascade();
+            fired += fireSlot(_slots[0][_now & SLOT_MASK]);
+        }
+
+        _advancing = false;
+        return fired;
+    }
+
+    /**
+     * Upper bound until next advance has something
+     * to do (fire or cascade), max if empty.
+     */
+    Clock::duration untilNext(Clock::time_point now) const {
+        if (_timers.empty()) {
+            return Clock::duration::max();
+        }
+
+        uint64_t ticks = SLOTS - (_now & SLOT_MASK);
+        for (uint64_t i = 1; i < ticks; ++i) {
+            if (!_slots[0][(_now + i) & SLOT_MASK].empty()) {
+                ticks = i;
+                break;
+            }
+        }
+
+        Clock::time_point at = _start +
+            _tick * static_cast<Clock::rep>(_now + ticks);
+        if (at <= now) {
+            return Clock::duration::zero();
+        }
+        return at - now;
+    }
+
+    int size() const {
+        return static_cast<int>(_timers.size());
+    }
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+    struct Node {
+        Node() : _id(0), _expiry(0), _period(0),
+            _prev(nullptr), _next(nullptr) {}
+
+        void makeSentinel() {
+            _prev = this;
+            _next = this;
+        }
+
+        bool empty() const {
+            return _next == this;
+        }
+
+        void unlink() {
+            _prev->_next = _next;
+            _next->_prev = _prev;
+            _prev = nullptr;
+            _next = nullptr;
+        }
+
+        void pushBack(Node* n) {
+            n->_prev = _prev;
+            n->_next = this;
+            _prev->_next = n;
+            _prev = n;
+        }
+
+        // move all nodes to another sentinel
+        void spliceTo(Node& other) {
+            other.makeSentinel();
+            if (empty()) {
+                return;
+            }
+            other._next = _next;
+            other._prev = _prev;
+            _next->_prev = &other;
+            _prev->_next = &other;
+            makeSentinel();
+        }
+
+        TimerId _id;
+        uint64_t _expiry;
+        uint64_t _period;
+        Callback _cb;
+        Node* _prev;
+        Node* _next;
+    };
+
+    uint64_t tickAt(Clock::time_point t) const {
+        return t > _start ?
+            static_cast<uint64_t>((t - _start) / _tick) : 0;
+    }
+
+    uint64_t toTicks(Clock::duration d) const {
+        if (d <= Clock::duration::zero()) {
+            return 0;
+        }
+        // round up, never fire early
+        return static_cast<uint64_t>((d + _tick - Clock::duration(1)) / _tick);
+    }
+
+    void insert(Node* n) {
+        uint64_t delta = n->_expiry - _now;
+        for (int l = 0; l < LEVELS; ++l) {
+            if (delta < (SLOTS << (SLOT_BITS * l)) || l == LEVELS - 1) {
+                // too far for top level, cascades
+                // down until it fits
+                uint64_t at = delta < (SLOTS << (SLOT_BITS * l)) ?
+                    n->_expiry : _now + (SLOTS << (SLOT_BITS * l)) - 1;
+                _slots[l][(at >> (SLOT_BITS * l)) & SLOT_MASK].pushBack(n);
+                return;
+            }
+        }
+    }
+
+    // reinserts higher level slots that
+    // became due into lower levels
+    void cascade() {
+        for (int l = 1; l < LEVELS; ++l) {
+            if (0 != (_now & ((uint64_t(1) << (SLOT_BITS * l)) - 1))) {
+                return;
+            }
+
+            Node pending;
+            _slots[l][(_now >> (SLOT_BITS * l)) & SLOT_MASK].spliceTo(pending);
+            while (!pending.empty()) {
+                Node* n = pending._next;
+                n->unlink();
+                insert(n);
+            }
+        }
+    }
+
+    int fireSlot(Node& slot) {
+        // callbacks may schedule or cancel
+        Node pending;
+        slot.spliceTo(pending);
+
+        int fired = 0;
+        while (!pending.empty()) {
+            Node* n = pending._next;
+            n->unlink();
+
+            _firing = n;
+            _firingCancelled = false;
+            n->_cb();
+            ++fired;
+            _firing = nullptr;
+
+            if (_firingCancelled) {
+                delete n;
+            } else if (n->_period > 0) {
+                n->_expiry = _now + n->_period;
+                insert(n);
+            } else {
+                _timers.erase(n->_id);
+                delete n;
+            }
+        }
+        return fired;
+    }
+
+    Clock::duration _tick;
+    Clock::time_point _start;
+    // current tick
+    uint64_t _now;
+    TimerId _lastId;
+    Node* _firing;
+    bool _firingCancelled;
+    bool _advancing;
+
+    Node _slots[LEVELS][SLOTS];
+    std::unordered_map< TimerId, Node* > _timers;
+};
+
+#endif /* end of include guard: TIMERWHEEL_H8N3V6QX */
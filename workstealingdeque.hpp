@@ -0,0 +1,147 @@
+#ifndef WORKSTEALINGDEQUE_R5T8W2LC
+#define WORKSTEALINGDEQUE_R5T8W2LC
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+// Lock-free work stealing deque (Chase-Lev, with
+// C11 memory orderings from Le et al.).
+// push/pop may only be called from the owner
+// thread (LIFO end), steal from any thread
+// (FIFO end).
+//
+// T should be cheap to copy, ie. a pointer.
+// Grown buffers are retired until destruction,
+// since stealers may still read old ones.
+template <class T>
+struct WorkStealingDeque {
+
+    explicit WorkStealingDeque(int capacity = 64) :
+        _top(0), _bottom(0),
+        _array(new Array(capacity))
+    {
+        assert( capacity > 0 && 0 == (capacity & (capacity - 1))
+            && "Capacity must be power of two." );
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque(WorkStealingDeque&&) = delete;
+
+    ~WorkStealingDeque() {
+        delete _array.load(std::memory_order_relaxed);
+        for (auto i: _retired) {
+            delete i;
+        }
+    }
+
+    // owner only
+    void push(const T& value) {
+        int64_t b = _bottom.load(std::memory_order_relaxed);
+        int64_t t = _top.load(std::memory_order_acquire);
+        Array* a = _array.load(std::memory_order_relaxed);
+        if (b - t > a->_capacity - 1) {
+            a = grow(a,b,t);
+        }
+        a->put(b,value);
+        std::atomic_thread_fence(std::memory_order_release);
+        _bottom.store(b + 1,std::memory_order_relaxed);
+    }
+
+    // owner only, takes most recently pushed
+    bool pop(T& out) {
+        int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = _array.load(std::memory_order_relaxed);
+        _bottom.store(b,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = _top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            // was empty
+            _bottom.store(b + 1,std::memory_order_relaxed);
+            return false;
+        }
+
+        out = a->get(b);
+        if (t == b) {
+            // last one, race against stealers
+            bool won = _top.compare_exchange_strong(t,t + 1,
+                std::memory_order_seq_cst,
+                std::memory_order_relaxed);
+            _bottom.store(b + 1,std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // any thread, takes oldest. Returns false if
+    // empty or lost race to other thread.
+    bool steal(T& out) {
+        int64_t t = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = _bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+
+        Array* a = _array.load(std::memory_order_acquire);
+        T value = a->get(t);
+        if (!_top.compare_exchange_strong(t,t + 1,
+            std::memory_order_seq_cst,
+            std::memory_order_relaxed))
+        {
+            return false;
+        }
+        out = value;
+        return true;
+    }
+
+    // estimate, exact only from owner
+    int size() const {
+        int64_t b = _bottom.load(std::memory_order_relaxed);
+        int64_t t = _top.load(std::memory_order_relaxed);
+        return b > t ? static_cast<int>(b - t) : 0;
+    }
+
+private:
+    struct Array {
+        explicit Array(int64_t capacity) :
+            _capacity(capacity), _mask(capacity - 1),
+            _buf(new std::atomic< T >[capacity]) {}
+
+        ~Array() {
+            delete[] _buf;
+        }
+
+        T get(int64_t i) const {
+            return _buf[i & _mask].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i,const T& value) {
+            _buf[i & _mask].store(value,std::memory_order_relaxed);
+        }
+
+        int64_t _capacity;
+        int64_t _mask;
+        std::atomic< T >* _buf;
+    };
+
+    Array* grow(Array* old,int64_t b,int64_t t) {
+        Array* a = new Array(old->_capacity * 2);
+        for (int64_t i = t; i < b; ++i) {
+            a->put(i,old->get(i));
+        }
+        _retired.push_back(old);
+        _array.store(a,std::memory_order_release);
+        return a;
+    }
+
+    std::atomic< int64_t > _top;
+    std::atomic< int64_t > _bottom;
+    std::atomic< Array* > _array;
+    // owner only
+    std::vector< Array* > _retired;
+};
+
+#endif /* end of include guard: WORKSTEALINGDEQUE_R5T8W2LC */